@@ -0,0 +1,113 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief User space microbenchmark of aesd_circular_buffer_find_entry_offset_for_fpos()
+ *
+ * Fills buffers of 10 up to max entries, by factors of 10, with commands of 1 to 80
+ * bytes, wrapping around once, then times lookups at random offsets and prints the
+ * mean time per lookup for each size.
+ *
+ * Usage: aesd-circular-buffer-bench [-n lookups] [-m max entries]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define COMMAND_MAX_SIZE 80
+
+static double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr, "Usage: %s [-n lookups] [-m max entries]\n", prog);
+}
+
+int main(int argc, char **argv) {
+
+    size_t lookups = 1000000;
+    size_t max_entries = 1000000;
+    static const char command[COMMAND_MAX_SIZE];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                lookups = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                max_entries = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (lookups == 0 || max_entries < 10) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct aesd_buffer_entry *entries = calloc(max_entries, sizeof(struct aesd_buffer_entry));
+    size_t *offsets = malloc(lookups * sizeof(size_t));
+    if (!entries || !offsets) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(1);
+
+    printf("%10s %12s %14s\n", "entries", "bytes", "ns_per_lookup");
+
+    for (size_t capacity = 10; capacity <= max_entries; capacity *= 10) {
+
+        struct aesd_circular_buffer buffer;
+        struct aesd_buffer_entry add_entry;
+        size_t entry_offset;
+        size_t found = 0;
+
+        aesd_circular_buffer_init_entries(&buffer, entries, capacity);
+
+        for (size_t i = 0; i < capacity + capacity / 2; i++) {
+            add_entry.buffptr = command;
+            add_entry.size = 1 + rand() % COMMAND_MAX_SIZE;
+            aesd_circular_buffer_add_entry(&buffer, &add_entry);
+        }
+
+        size_t bytes = buffer.end - buffer.base;
+
+        for (size_t i = 0; i < lookups; i++) {
+            offsets[i] = ((size_t)rand() * RAND_MAX + rand()) % bytes;
+        }
+
+        double start = now();
+
+        for (size_t i = 0; i < lookups; i++) {
+            found += aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i], &entry_offset) != NULL;
+        }
+
+        double elapsed = now() - start;
+
+        if (found != lookups) {
+            fprintf(stderr, "%zu lookups failed\n", lookups - found);
+            exit(EXIT_FAILURE);
+        }
+
+        printf("%10zu %12zu %14.1f\n", capacity, bytes, elapsed / lookups * 1e9);
+    }
+
+    free(offsets);
+    free(entries);
+
+    return 0;
+}
@@ -17,6 +17,19 @@
 #include "aesd-circular-buffer.h"
 
 /**
+ * @return the number of entries in @param buffer
+ */
+static size_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return buffer->capacity;
+    }
+
+    return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
+
+/**
+ * Binary search of the entry offsets, which increase from out_offs.
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
  *      character index if all buffer strings were concatenated end to end
@@ -29,24 +42,34 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    uint8_t i;
-    uint8_t n = 0;
-    size_t i_offset = 0;
-
-    for (i = buffer->out_offs;
-            (!buffer->full && (i != buffer->in_offs)) ||
-            (buffer->full && (n < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED));
-            i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, n++) {
-
-        if ((char_offset >= i_offset) && (char_offset < (i_offset + buffer->entry[i].size))) {
-            *entry_offset_byte_rtn = (char_offset - i_offset);
-            return &buffer->entry[i];
-        }
+    size_t low = 0;
+    size_t high = aesd_circular_buffer_count(buffer);
+    struct aesd_buffer_entry *entry;
 
-        i_offset += buffer->entry[i].size;
+    if (char_offset >= buffer->end - buffer->base) {
+        return NULL;
     }
 
-    return NULL;
+    // Find the last entry starting at or before char_offset, entries from low on
+    // start at or before it and those from high on after it
+
+    while (high - low > 1) {
+
+        size_t mid = low + (high - low) / 2;
+
+        entry = &buffer->entry[(buffer->out_offs + mid) % buffer->capacity];
+
+        if (entry->offset - buffer->base <= char_offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    entry = &buffer->entry[(buffer->out_offs + low) % buffer->capacity];
+    *entry_offset_byte_rtn = char_offset - (entry->offset - buffer->base);
+
+    return entry;
 }
 
 /**
@@ -59,9 +82,15 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
 
+    if (buffer->full) {
+        buffer->base += buffer->entry[buffer->in_offs].size;
+    }
+
     buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
     buffer->entry[buffer->in_offs].size = add_entry->size;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->entry[buffer->in_offs].offset = buffer->end;
+    buffer->end += add_entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
 
     if (buffer->full) {
         buffer->out_offs = buffer->in_offs;
@@ -73,9 +102,45 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Removes the oldest entry of @param buffer, advancing buffer->out_offs past it.
+* Any necessary locking must be handled by the caller
+* @return the removed entry, whose memory the caller may then release, or NULL if the buffer is empty.
+* The entry stays valid until the next call to aesd_circular_buffer_add_entry()
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+
+    if (!buffer->full && (buffer->out_offs == buffer->in_offs)) {
+        return NULL;
+    }
+
+    entry = &buffer->entry[buffer->out_offs];
+    buffer->base += entry->size;
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+    buffer->full = false;
+
+    return entry;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct of
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+    aesd_circular_buffer_init_entries(buffer, buffer->entry_default, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct of
+* @param capacity entries, stored in the array @param entry allocated by the caller
+*/
+void aesd_circular_buffer_init_entries(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entry, size_t capacity)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    memset(entry,0,capacity * sizeof(struct aesd_buffer_entry));
+    buffer->entry = entry;
+    buffer->capacity = capacity;
 }
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Fill the aesdchar device with commands written one write() each, then read it
+# back with dd and print a CSV row of the read() calls it took and the throughput,
+# to compare driver versions.  Load the module with aesd_max_entries at least the
+# number of commands, for instance ./aesdchar_load aesd_max_entries=100000, and
+# start from an empty device.
+#
+# Usage: aesdchar-read-bench.sh [commands] [command size] [read size]
+
+device=${DEVICE:-/dev/aesdchar}
+commands=${1:-10000}
+size=${2:-64}
+bs=${3:-65536}
+
+line=$(head -c $((size - 1)) /dev/zero | tr '\0' x)
+
+exec 3>>"$device" || exit 1
+i=0
+while [ $i -lt "$commands" ]; do
+    printf '%s\n' "$line" >&3
+    i=$((i + 1))
+done
+exec 3>&-
+
+start=$(date +%s.%N)
+records=$(dd if="$device" of=/dev/null bs="$bs" 2>&1 | awk '/records in/ { split($1, n, "+"); print n[1] + n[2] }')
+end=$(date +%s.%N)
+
+echo "commands,command_size,read_size,bytes,read_calls,elapsed_s,mb_per_s"
+awk -v c="$commands" -v s="$size" -v b="$bs" -v r="$records" -v t0="$start" -v t1="$end" 'BEGIN {
+    t = t1 - t0
+    printf "%d,%d,%d,%d,%d,%.6f,%.1f\n", c, s, b, c * s, r, t, c * s / t / 1e6
+}'
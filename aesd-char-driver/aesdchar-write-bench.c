@@ -0,0 +1,127 @@
+/**
+ * @file aesdchar-write-bench.c
+ * @brief Benchmark of command writes to the aesdchar device
+ *
+ * Writes commands of 16, 256 and 4096 bytes, or the sizes given, each in the given
+ * number of write() calls so that partial commands are exercised too, and prints a
+ * CSV row per size with the commands written per second.
+ *
+ * Usage: aesdchar-write-bench [-n commands] [-p parts] [-f device] [size...]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+static double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr, "Usage: %s [-n commands] [-p parts] [-f device] [size...]\n", prog);
+}
+
+/**
+ * Write commands of size bytes, each in parts write() calls.
+ * @return the elapsed time in seconds, or a negative value on error
+ */
+static double run(int fd, const char *command, size_t size, long commands, size_t parts) {
+
+    size_t part = (size + parts - 1) / parts;
+    double start = now();
+
+    for (long i = 0; i < commands; i++) {
+        for (size_t offset = 0; offset < size; offset += part) {
+            size_t n = size - offset < part ? size - offset : part;
+            if (write(fd, &command[offset], n) != (ssize_t)n) {
+                perror("write");
+                return -1;
+            }
+        }
+    }
+
+    return now() - start;
+}
+
+int main(int argc, char **argv) {
+
+    static const size_t default_sizes[] = { 16, 256, 4096 };
+    const char *device = "/dev/aesdchar";
+    long commands = 100000;
+    size_t parts = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:f:")) != -1) {
+        switch (opt) {
+            case 'n':
+                commands = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                parts = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                device = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (commands <= 0 || parts == 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(device, O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    int nsizes = optind < argc ? argc - optind : 3;
+
+    printf("command_size,parts,commands,elapsed_s,commands_per_s,mb_per_s\n");
+
+    for (int i = 0; i < nsizes; i++) {
+
+        size_t size = optind < argc ? strtoul(argv[optind + i], NULL, 10) : default_sizes[i];
+
+        if (size < parts) {
+            fprintf(stderr, "size %zu is smaller than %zu parts\n", size, parts);
+            exit(EXIT_FAILURE);
+        }
+
+        char *command = malloc(size);
+        if (!command) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        memset(command, 'x', size - 1);
+        command[size - 1] = '\n';
+
+        double elapsed = run(fd, command, size, commands, parts);
+        if (elapsed < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        printf("%zu,%zu,%ld,%.6f,%.0f,%.1f\n", size, parts, commands, elapsed,
+                commands / elapsed, commands * size / elapsed / 1e6);
+
+        free(command);
+    }
+
+    close(fd);
+
+    return 0;
+}
@@ -23,15 +23,48 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * Default size of the ring of bytes the commands are stored in
+ */
+#define AESD_ARENA_SIZE (1024 * 1024)
+
+/**
+ * Size of the blocks an unterminated command is staged in, from a kmem_cache
+ */
+#define AESD_STAGING_BLOCK_SIZE 4096
+#define AESD_STAGING_DATA_SIZE (AESD_STAGING_BLOCK_SIZE - sizeof(struct aesd_staging_block))
+
 struct aesd_dev
 {
     struct aesd_circular_buffer buffer;
     size_t buffer_size;
     size_t buffer_len;
-    struct aesd_buffer_entry add_entry;
+    char *arena;
+    size_t arena_size;
+    size_t arena_head;    /* Where the next command goes in the arena */
     struct mutex lock;
     struct cdev cdev;     /* Char device structure      */
 };
 
+struct aesd_staging_block
+{
+    struct aesd_staging_block *next;
+    size_t size;
+    char data[];
+};
+
+/**
+ * State of an open file of the device: the unterminated command written through
+ * it, staged in a chain of blocks until its newline commits it to the device
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    struct aesd_staging_block *first;
+    struct aesd_staging_block *last;
+    size_t staged;
+    struct mutex lock;    /* Serializes writes through the file */
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
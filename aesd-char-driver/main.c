@@ -19,42 +19,106 @@
 #include <linux/mutex.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/mm.h> // kvcalloc
+#include <linux/uaccess.h> // get_user
+#include <linux/moduleparam.h>
 #include "aesd-circular-buffer.h"
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+unsigned int aesd_max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+unsigned long aesd_max_bytes = 0;
+unsigned long aesd_arena_size = AESD_ARENA_SIZE;
+
+module_param(aesd_max_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_entries, "Number of commands kept");
+module_param(aesd_max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_bytes, "Bytes kept, oldest commands are dropped beyond it (0 for no limit)");
+module_param(aesd_arena_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_arena_size, "Bytes of storage for commands, also the largest command accepted (EFBIG beyond)");
 
 MODULE_AUTHOR("Doug Weber");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+struct kmem_cache *aesd_staging_cache;
+
+/**
+ * Shrink the staged command of file to its first size bytes, freeing the blocks past
+ * them but keeping the first block for the next command.  The caller holds file->lock
+ */
+static void aesd_staging_truncate(struct aesd_file *file, size_t size)
+{
+    struct aesd_staging_block *block = file->first;
+    struct aesd_staging_block *next;
+    struct aesd_staging_block *unused;
+    size_t kept = 0;
+
+    if (!block)
+        return;
+
+    while (block->next && kept + block->size < size) {
+        kept += block->size;
+        block = block->next;
+    }
+
+    block->size = size - kept;
+    next = block->next;
+    block->next = NULL;
+    file->last = block;
+
+    while (next) {
+        unused = next;
+        next = next->next;
+        kmem_cache_free(aesd_staging_cache, unused);
+    }
+
+    file->staged = size;
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
-    struct aesd_dev *dev;
+    struct aesd_file *file;
 
     PDEBUG("open");
 
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&file->lock);
+    filp->private_data = file;
 
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+
     PDEBUG("release");
 
+    // An unterminated command is dropped with its file
+
+    aesd_staging_truncate(file, 0);
+    if (file->first)
+        kmem_cache_free(aesd_staging_cache, file->first);
+    kfree(file);
+
     return 0;
 }
 
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct aesd_dev *dev = filp->private_data; 
+	struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev; 
     struct aesd_buffer_entry *entry;
     size_t entry_offset;
+    size_t n;
+    size_t left;
     ssize_t retval = 0;
 
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
@@ -62,90 +126,246 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     if (mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS;
 
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset);
+    // Fill buf from as many consecutive entries as fit, rather than one per call
 
-    if (!entry)
-		goto out;
+    while ((size_t)retval < count) {
 
-    if ((entry->size - entry_offset) < count) {
-        count = entry->size - entry_offset;
-    }
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset);
 
-	if (copy_to_user(buf, entry->buffptr + entry_offset, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
+        if (!entry)
+            break;
 
-	*f_pos += count;
-    retval = count;
+        n = min_t(size_t, entry->size - entry_offset, count - retval);
+        left = copy_to_user(buf + retval, entry->buffptr + entry_offset, n);
+
+        *f_pos += n - left;
+        retval += n - left;
+
+        if (left) {
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+    }
 
-out:
     mutex_unlock(&dev->lock);
     return retval;
 }
 
+/**
+ * Drop the oldest command of dev, which must not be empty, releasing its bytes of the
+ * arena.  The caller holds dev->lock
+ */
+static void aesd_remove_oldest(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_remove_entry(&dev->buffer);
+
+    dev->buffer_size -= entry->size;
+    dev->buffer_len--;
+
+    entry->buffptr = NULL;
+    entry->size = 0;
+}
+
+/**
+ * Make room in the arena for a command of size bytes after the newest command, or at
+ * the start of the arena, dropping the oldest commands as needed.  The caller holds
+ * dev->lock and checked that size fits in the arena
+ * @return the address for the command
+ */
+static char *aesd_arena_reserve(struct aesd_dev *dev, size_t size)
+{
+    size_t head = dev->arena_head;
+    size_t tail;
+
+    while (true) {
+
+        // With no commands left the whole arena is free
+
+        if (dev->buffer_len == 0) {
+            if (head + size > dev->arena_size)
+                head = 0;
+            break;
+        }
+
+        // The commands run from the oldest at tail up to head, or to the end of the
+        // arena and on from its start up to head once wrapped, which head meeting
+        // tail means as commands are never empty
+
+        tail = dev->buffer.entry[dev->buffer.out_offs].buffptr - dev->arena;
+
+        if (head > tail) {
+            if (head + size <= dev->arena_size)
+                break;
+            if (size <= tail) {
+                head = 0;
+                break;
+            }
+        } else if (head + size <= tail) {
+            break;
+        }
+
+        aesd_remove_oldest(dev);
+    }
+
+    return dev->arena + head;
+}
+
+/**
+ * Add the command of size bytes at buffptr, reserved with aesd_arena_reserve(), as
+ * the newest command of dev.  The caller holds dev->lock
+ */
+static void aesd_add_command(struct aesd_dev *dev, char *buffptr, size_t size)
+{
+    struct aesd_buffer_entry add_entry = {
+        .buffptr = buffptr,
+        .size = size,
+    };
+
+    aesd_circular_buffer_add_entry(&dev->buffer, &add_entry);
+    dev->buffer_size += size;
+    dev->buffer_len++;
+    dev->arena_head = buffptr + size - dev->arena;
+}
+
+/**
+ * Drop the oldest commands of dev while it is full, or a command of size bytes
+ * would take it past aesd_max_bytes.  The caller holds dev->lock
+ */
+static void aesd_make_room(struct aesd_dev *dev, size_t size)
+{
+    while (dev->buffer.full ||
+            (aesd_max_bytes && dev->buffer_len &&
+             dev->buffer_size + size > aesd_max_bytes)) {
+        aesd_remove_oldest(dev);
+    }
+}
+
+/**
+ * Stage count bytes of buf after the unterminated command of file, in as many
+ * blocks as needed, without copying the bytes already staged.  The caller holds
+ * file->lock
+ * @return 0, or a negative errno with the staged command unchanged
+ */
+static int aesd_staging_append(struct aesd_file *file, const char __user *buf, size_t count)
+{
+    struct aesd_staging_block *block;
+    size_t copied = 0;
+    size_t n;
+
+    while (copied < count) {
+
+        block = file->last;
+
+        if (!block || block->size == AESD_STAGING_DATA_SIZE) {
+
+            block = kmem_cache_alloc(aesd_staging_cache, GFP_KERNEL);
+            if (!block) {
+                aesd_staging_truncate(file, file->staged);
+                return -ENOMEM;
+            }
+
+            block->next = NULL;
+            block->size = 0;
+
+            if (file->last)
+                file->last->next = block;
+            else
+                file->first = block;
+
+            file->last = block;
+        }
+
+        n = min_t(size_t, count - copied, AESD_STAGING_DATA_SIZE - block->size);
+
+        if (copy_from_user(block->data + block->size, buf + copied, n)) {
+            aesd_staging_truncate(file, file->staged);
+            return -EFAULT;
+        }
+
+        block->size += n;
+        copied += n;
+    }
+
+    file->staged += count;
+
+    return 0;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct aesd_dev *dev = filp->private_data; 
-    ssize_t retval = -ENOMEM;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_staging_block *block;
+    ssize_t retval = -EFBIG;
     char *buffptr_new;
+    size_t offset = 0;
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
 
-    if (mutex_lock_interruptible(&dev->lock))
+    if (count == 0)
+        return 0;
+
+    if (mutex_lock_interruptible(&file->lock))
         return -ERESTARTSYS;
 
-    // Allocate or reallocate depending if add entry contains unterminated commands.
+    // A command too large for the arena is dropped, before anything is copied or
+    // any older command dropped for it
 
-    if (!dev->add_entry.buffptr) {
-        buffptr_new = kmalloc(count, GFP_KERNEL);
-    } else {
-        buffptr_new = krealloc(dev->add_entry.buffptr, dev->add_entry.size + count, GFP_KERNEL);
+    if (file->staged + count > dev->arena_size) {
+        aesd_staging_truncate(file, 0);
+        goto out;
     }
 
-    if (!buffptr_new)
-        goto out;
+    // The command is staged in file, outside of the device lock, and only copied to
+    // the arena once terminated, so that writers through other files can build their
+    // commands meanwhile without interleaving with this one.  A faulting buffer thus
+    // fails the write before any command is dropped to make room.
 
-    if (copy_from_user(buffptr_new + dev->add_entry.size, buf, count)) {
-        retval = -EFAULT;
+    retval = aesd_staging_append(file, buf, count);
+    if (retval < 0)
         goto out;
-    }
 
-    dev->add_entry.buffptr = buffptr_new;
-    dev->add_entry.size = dev->add_entry.size + count;
+    // Whether the command is terminated is decided from the bytes copied, which the
+    // writer cannot change any more
 
-    // If terminated, write to buffer
+    if (file->last->data[file->last->size - 1] == '\n') {
 
-    if (dev->add_entry.buffptr[dev->add_entry.size-1] == '\n') {
+        if (mutex_lock_interruptible(&dev->lock)) {
+            aesd_staging_truncate(file, file->staged - count);
+            retval = -ERESTARTSYS;
+            goto out;
+        }
 
-        // Free next entry if buffer is already full
+        aesd_make_room(dev, file->staged);
+        buffptr_new = aesd_arena_reserve(dev, file->staged);
 
-        if (dev->buffer.full) {
-            kfree(dev->buffer.entry[dev->buffer.in_offs].buffptr);
-            dev->buffer_size -= dev->buffer.entry[dev->buffer.in_offs].size;
-        } else {
-            dev->buffer_len++;
+        for (block = file->first; block; block = block->next) {
+            memcpy(buffptr_new + offset, block->data, block->size);
+            offset += block->size;
         }
 
-        aesd_circular_buffer_add_entry(&dev->buffer, &dev->add_entry);
-        dev->buffer_size += dev->add_entry.size;
+        aesd_add_command(dev, buffptr_new, file->staged);
 
-        dev->add_entry.buffptr = NULL;
-        dev->add_entry.size = 0;
+        mutex_unlock(&dev->lock);
+
+        aesd_staging_truncate(file, 0);
     }
 
-	*f_pos += count;
     retval = count;
 
 out:
-    mutex_unlock(&dev->lock);
+    if (retval > 0)
+        *f_pos += count;
+
+    mutex_unlock(&file->lock);
     return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
-	struct aesd_dev *dev = filp->private_data; 
+	struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev; 
     loff_t retval;
 
     if (mutex_lock_interruptible(&dev->lock))
@@ -160,11 +380,9 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 
 static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset)
 {
-	struct aesd_dev *dev = filp->private_data; 
+	struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev; 
     struct aesd_buffer_entry *entry;
-    unsigned int i;
     long retval = 0;
-    size_t start_offset = 0;
 
     if (mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS;
@@ -174,21 +392,14 @@ static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, u
         goto out;
     }
 
-    entry = &dev->buffer.entry[(dev->buffer.out_offs + write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    entry = &dev->buffer.entry[(dev->buffer.out_offs + write_cmd) % dev->buffer.capacity];
 
     if (write_cmd_offset >= entry->size) {
         retval = -EINVAL;
         goto out;
     }
 
-    for (i = dev->buffer.out_offs;
-            i != ((dev->buffer.out_offs + write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
-            i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-    {
-        start_offset += dev->buffer.entry[i].size;
-    }
-
-    filp->f_pos = start_offset + write_cmd_offset;
+    filp->f_pos = (entry->offset - dev->buffer.base) + write_cmd_offset;
 
 out:
     mutex_unlock(&dev->lock);
@@ -257,19 +468,41 @@ int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+    struct aesd_buffer_entry *entry;
+    char *arena;
+
+    if (aesd_max_entries == 0) {
+        printk(KERN_WARNING "aesd_max_entries must be at least 1\n");
+        return -EINVAL;
+    }
+
+    if (aesd_arena_size == 0) {
+        printk(KERN_WARNING "aesd_arena_size must be at least 1\n");
+        return -EINVAL;
+    }
+
+    entry = kvcalloc(aesd_max_entries, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    arena = kvmalloc(aesd_arena_size, GFP_KERNEL);
+    aesd_staging_cache = kmem_cache_create("aesdchar_staging", AESD_STAGING_BLOCK_SIZE, 0, 0, NULL);
+    if (!entry || !arena || !aesd_staging_cache) {
+        result = -ENOMEM;
+        goto fail;
+    }
 
     result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
-        return result;
+        goto fail;
     }
 
     memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    aesd_circular_buffer_init(&aesd_device.buffer);
+    aesd_circular_buffer_init_entries(&aesd_device.buffer, entry, aesd_max_entries);
+
+    aesd_device.arena = arena;
+    aesd_device.arena_size = aesd_arena_size;
 
-    memset(&aesd_device.add_entry, 0, sizeof(struct aesd_buffer_entry));
 
     mutex_init(&aesd_device.lock);
 
@@ -277,28 +510,29 @@ int aesd_init_module(void)
 
     if (result) {
         unregister_chrdev_region(dev, 1);
+        goto fail;
     }
 
+    return 0;
+
+fail:
+    kvfree(entry);
+    kvfree(arena);
+    kmem_cache_destroy(aesd_staging_cache);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     cdev_del(&aesd_device.cdev);
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
-        kfree(entry->buffptr);
-    }
-
-    // Free any unterminated commands
+    // Commands all live in the arena, unterminated ones were freed with their files
 
-    if (aesd_device.add_entry.buffptr) {
-        kfree(aesd_device.add_entry.buffptr);
-    }
+    kvfree(aesd_device.buffer.entry);
+    kvfree(aesd_device.arena);
+    kmem_cache_destroy(aesd_staging_cache);
 
     unregister_chrdev_region(devno, 1);
 }
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Run a fixed set of aesdloadgen scenarios against a running aesdsocket and print
+# one CSV row per scenario, so results can be compared between releases.  Works
+# against both the file and the aesdchar builds.  Replies grow with the history,
+# so start the server with an empty one.  Any arguments, such as -m <pid> or -i
+# for a file build, are passed to every run.
+#
+# Usage: aesdbench.sh [aesdloadgen options]
+
+loadgen=${LOADGEN:-$(dirname "$0")/aesdloadgen}
+rc=0
+header=1
+
+run() {
+    name=$1
+    shift
+    output=$("$loadgen" -o csv "$@") || rc=1
+    if [ $header -eq 1 ]; then
+        echo "scenario,$(echo "$output" | head -n 1)"
+        header=0
+    fi
+    echo "$name,$(echo "$output" | tail -n 1)"
+}
+
+run connect -c 8 -n 200 -l 0 "$@"
+run line -c 8 -n 50 -l 1 "$@"
+run lines -c 8 -n 4 -l 100 "$@"
+run pipelined -c 8 -n 4 -l 256 -d 16 "$@"
+run large -c 4 -n 4 -l 4 -L 64K "$@"
+run paced -c 8 -n 4 -l 50 -r 2000 "$@"
+
+exit $rc
@@ -0,0 +1,716 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PORT 9000
+#define RECV_BUFFER_SIZE 65536
+#define SEED_LINE_SIZE 1024
+#define TOKEN_SIZE 128
+#define PAD_CHUNK_SIZE 65536
+#define REPLY_TIMEOUT 30
+#define INCREMENTAL_COMMAND "AESDSOCKET_INCREMENTAL:1\n"
+
+enum output_format {
+    OUTPUT_TEXT,
+    OUTPUT_CSV,
+    OUTPUT_JSON,
+};
+
+/**
+ * One client thread.  With a rate, its batches are sent on a fixed schedule from
+ * start and their latency runs from when they were due rather than when they
+ * went out, so a stalled server is not hidden by the client waiting on it.
+ */
+struct client_params {
+    int id;
+    struct sockaddr_storage address;
+    socklen_t addrlen;
+    int connections;
+    int lines;
+    int depth;
+    size_t line_size;
+    bool incremental;
+    double rate;
+    double start;
+    size_t scheduled;
+    double *latencies;
+    size_t nlatencies;
+    size_t lines_sent;
+    size_t bytes_received;
+    size_t recv_calls;
+    int failures;
+    int errors;
+};
+
+/**
+ * Totals over all clients, for the report.
+ */
+struct results {
+    int clients;
+    int connections;
+    int lines;
+    int depth;
+    size_t line_size;
+    double rate;
+    int failures;
+    int errors;
+    size_t lines_sent;
+    size_t bytes_received;
+    size_t recv_calls;
+    double elapsed;
+    double p50;
+    double p99;
+    double p999;
+    double max;
+    long peak_rss;
+};
+
+static double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double when) {
+
+    struct timespec ts = {
+        .tv_sec = (time_t)when,
+        .tv_nsec = (long)((when - (time_t)when) * 1e9),
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static char pad_chunk[PAD_CHUNK_SIZE];
+
+static int send_all(int fd, const char *buf, size_t len) {
+
+    while (len > 0) {
+        ssize_t nsend = send(fd, buf, len, MSG_NOSIGNAL);
+        if (nsend < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nsend;
+        len -= nsend;
+    }
+
+    return 0;
+}
+
+/**
+ * Send len bytes of padding, streamed from a fixed chunk so that lines far larger
+ * than the client's memory can be generated.
+ * @return 0 on success, -1 on error
+ */
+static int send_padding(int fd, size_t len) {
+
+    while (len > 0) {
+        size_t n = len < sizeof(pad_chunk) ? len : sizeof(pad_chunk);
+        if (send_all(fd, pad_chunk, n) < 0) {
+            return -1;
+        }
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Send a batch of lines, each padded to line_size bytes when line_size is set.
+ * Padding goes ahead of the token so the token still ends the line.
+ * @return 0 on success, -1 on error
+ */
+static int send_batch(int fd, const char *batch, size_t batch_len, size_t line_size) {
+
+    if (line_size == 0) {
+        return send_all(fd, batch, batch_len);
+    }
+
+    for (const char *t = batch; t < &batch[batch_len]; ) {
+        size_t len = strchr(t, '\n') - t + 1;
+        if (send_padding(fd, line_size > len ? line_size - len : 0) < 0 || send_all(fd, t, len) < 0) {
+            return -1;
+        }
+        t += len;
+    }
+
+    return 0;
+}
+
+/**
+ * Receive until token has been seen in the replay stream.  Every reply is the
+ * whole history, which always contains the line just sent, so the token marks
+ * the point where the reply to that line is complete.  Bytes after the token
+ * are kept in buffer for the next search.  If stop is seen first, the search
+ * ends there instead.
+ * @return 0 once token is found, 1 if stop was found before it, -1 on error or
+ * disconnect
+ */
+static int recv_token(int fd, char *buffer, size_t *buffer_len, const char *token, size_t token_len,
+        const char *stop, size_t stop_len, struct client_params *params) {
+
+    size_t keep = (token_len > stop_len ? token_len : stop_len) - 1;
+
+    while (true) {
+
+        char *found = memmem(buffer, *buffer_len, token, token_len);
+        char *stopped = stop ? memmem(buffer, *buffer_len, stop, stop_len) : NULL;
+
+        if (stopped && (!found || stopped < found)) {
+            found = stopped;
+            token_len = stop_len;
+        }
+
+        if (found) {
+            size_t consumed = (found - buffer) + token_len;
+            *buffer_len -= consumed;
+            memmove(buffer, &buffer[consumed], *buffer_len);
+            return found == stopped ? 1 : 0;
+        }
+
+        // Keep the tail that could hold the start of a token split across reads
+
+        if (*buffer_len > keep) {
+            memmove(buffer, &buffer[*buffer_len - keep], keep);
+            *buffer_len = keep;
+        }
+
+        ssize_t nread = recv(fd, &buffer[*buffer_len], RECV_BUFFER_SIZE - *buffer_len, 0);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (nread == 0) {
+            return -1;
+        }
+
+        params->bytes_received += nread;
+        params->recv_calls++;
+        *buffer_len += nread;
+    }
+}
+
+/**
+ * Receive the reply to a batch, checking that every line of it was replayed in
+ * the order it was sent.  A line missing or out of order counts as an error.
+ * @return 0 on success, -1 on error or disconnect
+ */
+static int recv_batch(int fd, char *buffer, size_t *buffer_len, const char *batch,
+        const size_t *offsets, int n, struct client_params *params) {
+
+    const char *last = &batch[offsets[n - 1]];
+    size_t last_len = offsets[n] - offsets[n - 1];
+
+    for (int i = 0; i < n - 1; i++) {
+
+        int rc = recv_token(fd, buffer, buffer_len, &batch[offsets[i]], offsets[i + 1] - offsets[i],
+                last, last_len, params);
+        if (rc != 0) {
+            if (rc > 0) {
+                params->errors++;
+            }
+            return rc < 0 ? -1 : 0;
+        }
+    }
+
+    return recv_token(fd, buffer, buffer_len, last, last_len, NULL, 0, params);
+}
+
+void *client_thread(void *arg) {
+
+    struct client_params *params = (struct client_params*)arg;
+    char *buffer = malloc(RECV_BUFFER_SIZE);
+    char *batch = malloc(TOKEN_SIZE * params->depth);
+    size_t *offsets = malloc(sizeof(size_t) * (params->depth + 1));
+
+    if (!buffer || !batch || !offsets) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int c = 0; c < params->connections; c++) {
+
+        size_t buffer_len = 0;
+        int fd = socket(params->address.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+
+        if (connect(fd, (struct sockaddr*)&params->address, params->addrlen) < 0) {
+            params->failures++;
+            close(fd);
+            continue;
+        }
+
+        // A reply that never completes, with a line dropped, fails the connection
+
+        struct timeval timeout = {
+            .tv_sec = REPLY_TIMEOUT,
+        };
+
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+            perror("setsockopt");
+            exit(EXIT_FAILURE);
+        }
+
+        // Have every line answered with only what was appended since the last reply
+
+        if (params->incremental && send_all(fd, INCREMENTAL_COMMAND, strlen(INCREMENTAL_COMMAND)) < 0) {
+            params->failures++;
+            close(fd);
+            continue;
+        }
+
+        // Send up to depth lines at once, on schedule when rate limited, then wait for
+        // the reply holding all of them
+
+        for (int l = 0; l < params->lines; ) {
+
+            size_t batch_len = 0;
+            int n;
+
+            for (n = 0; n < params->depth && l < params->lines; n++, l++) {
+                offsets[n] = batch_len;
+                batch_len += snprintf(&batch[batch_len], TOKEN_SIZE, "aesdloadgen:%d:%d:%d:%d\n",
+                        (int)getpid(), params->id, c, l);
+            }
+            offsets[n] = batch_len;
+
+            double start;
+
+            if (params->rate > 0) {
+                start = params->start + params->scheduled / params->rate;
+                sleep_until(start);
+                params->scheduled += n;
+            } else {
+                start = now();
+            }
+
+            if (send_batch(fd, batch, batch_len, params->line_size) < 0 ||
+                    recv_batch(fd, buffer, &buffer_len, batch, offsets, n, params) < 0) {
+                params->failures++;
+                break;
+            }
+
+            params->latencies[params->nlatencies++] = now() - start;
+            params->lines_sent += n;
+        }
+
+        close(fd);
+    }
+
+    free(offsets);
+    free(batch);
+    free(buffer);
+
+    return params;
+}
+
+static int compare_double(const void *a, const void *b) {
+
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+    return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t index = (size_t)(p * (n - 1) + 0.5);
+    return sorted[index];
+}
+
+/**
+ * Parse a byte count with an optional K, M or G suffix.
+ */
+static size_t parse_size(const char *arg) {
+
+    char *end;
+    size_t size = strtoull(arg, &end, 10);
+
+    switch (*end) {
+        case 'G':
+            size *= 1024;
+            // fallthrough
+        case 'M':
+            size *= 1024;
+            // fallthrough
+        case 'K':
+            size *= 1024;
+            break;
+    }
+
+    return size;
+}
+
+/**
+ * Peak resident set size of a process in kB, used to watch the server's memory
+ * while it is being loaded.
+ * @return the size, or -1 if it could not be read
+ */
+static long read_peak_rss(pid_t pid) {
+
+    char path[64];
+    char line[256];
+    long peak = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmHWM: %ld", &peak) == 1) {
+            break;
+        }
+    }
+
+    fclose(file);
+
+    return peak;
+}
+
+static void print_results(const struct results *r, enum output_format format) {
+
+    int total_connections = r->clients * r->connections;
+
+    switch (format) {
+        case OUTPUT_TEXT:
+            printf("connections:      %d\n", total_connections);
+            printf("failures:         %d\n", r->failures);
+            printf("errors:           %d\n", r->errors);
+            printf("lines:            %zu\n", r->lines_sent);
+            printf("elapsed:          %.3f s\n", r->elapsed);
+            printf("connections/sec:  %.1f\n", total_connections / r->elapsed);
+            printf("lines/sec:        %.1f\n", r->lines_sent / r->elapsed);
+            printf("received:         %.1f MiB, %.1f MiB/s\n", r->bytes_received / (1024.0 * 1024),
+                    r->bytes_received / r->elapsed / (1024 * 1024));
+            printf("recv calls:       %zu\n", r->recv_calls);
+            printf("latency p50:      %.1f us\n", r->p50 * 1e6);
+            printf("latency p99:      %.1f us\n", r->p99 * 1e6);
+            printf("latency p999:     %.1f us\n", r->p999 * 1e6);
+            printf("latency max:      %.1f us\n", r->max * 1e6);
+            if (r->peak_rss >= 0) {
+                printf("server peak rss:  %ld kB\n", r->peak_rss);
+            }
+            break;
+        case OUTPUT_CSV:
+            printf("clients,connections,lines,depth,line_size,rate,failures,errors,lines_sent,"
+                    "elapsed_s,connections_per_s,lines_per_s,received_bytes,recv_calls,"
+                    "p50_us,p99_us,p999_us,max_us,server_peak_rss_kb\n");
+            printf("%d,%d,%d,%d,%zu,%.1f,%d,%d,%zu,%.6f,%.1f,%.1f,%zu,%zu,%.1f,%.1f,%.1f,%.1f,%ld\n",
+                    r->clients, r->connections, r->lines, r->depth, r->line_size, r->rate,
+                    r->failures, r->errors, r->lines_sent, r->elapsed, total_connections / r->elapsed,
+                    r->lines_sent / r->elapsed, r->bytes_received, r->recv_calls, r->p50 * 1e6,
+                    r->p99 * 1e6, r->p999 * 1e6, r->max * 1e6, r->peak_rss);
+            break;
+        case OUTPUT_JSON:
+            printf("{\"clients\": %d, \"connections\": %d, \"lines\": %d, \"depth\": %d, "
+                    "\"line_size\": %zu, \"rate\": %.1f, \"failures\": %d, \"errors\": %d, "
+                    "\"lines_sent\": %zu, \"elapsed_s\": %.6f, \"connections_per_s\": %.1f, "
+                    "\"lines_per_s\": %.1f, \"received_bytes\": %zu, \"recv_calls\": %zu, "
+                    "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, "
+                    "\"server_peak_rss_kb\": %ld}\n",
+                    r->clients, r->connections, r->lines, r->depth, r->line_size, r->rate,
+                    r->failures, r->errors, r->lines_sent, r->elapsed, total_connections / r->elapsed,
+                    r->lines_sent / r->elapsed, r->bytes_received, r->recv_calls, r->p50 * 1e6,
+                    r->p99 * 1e6, r->p999 * 1e6, r->max * 1e6, r->peak_rss);
+            break;
+    }
+}
+
+/**
+ * Append size bytes of history lines to the data file, so that replay throughput
+ * can be measured against a large history without having to send it through the
+ * server.  The server must be started afterwards.
+ */
+static void seed_file(const char *path, size_t size) {
+
+    char line[SEED_LINE_SIZE];
+    size_t written = 0;
+
+    FILE *file = fopen(path, "a");
+    if (!file) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+
+    while (written < size) {
+        size_t n = sizeof(line);
+        if (n > size - written) {
+            n = size - written;
+            line[n - 1] = '\n';
+        }
+        if (fwrite(line, 1, n, file) != n) {
+            perror("fwrite");
+            exit(EXIT_FAILURE);
+        }
+        written += n;
+    }
+
+    if (fclose(file) != 0) {
+        perror("fclose");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c clients] [-n connections] [-l lines] [-d depth]\n"
+            "       [-u path] [-L size] [-r rate] [-i] [-m pid] [-o format]\n", prog);
+    fprintf(stderr, "  -h host         server address (default 127.0.0.1)\n");
+    fprintf(stderr, "  -p port         server port (default %d)\n", PORT);
+    fprintf(stderr, "  -u path         connect to the server's Unix socket instead\n");
+    fprintf(stderr, "  -c clients      concurrent client threads (default 8)\n");
+    fprintf(stderr, "  -n connections  connections opened by each client in turn (default 100)\n");
+    fprintf(stderr, "  -l lines        lines sent on each connection, 0 to only connect and\n");
+    fprintf(stderr, "                  close (default 1)\n");
+    fprintf(stderr, "  -d depth        pipelining depth, lines sent together before waiting for\n");
+    fprintf(stderr, "                  the reply to the last of them (default 1)\n");
+    fprintf(stderr, "  -L size         pad every line to size bytes (K, M or G suffix)\n");
+    fprintf(stderr, "  -r rate         send at most this many lines per second over all clients,\n");
+    fprintf(stderr, "                  timing each from when it was due to be sent\n");
+    fprintf(stderr, "  -i              ask for incremental replies (file mode servers only)\n");
+    fprintf(stderr, "  -m pid          report the peak resident set size of the server process\n");
+    fprintf(stderr, "  -o format       report as \"text\" (default), \"csv\" or \"json\"\n");
+    fprintf(stderr, "  -f file -s size append size bytes (K, M or G suffix) of history to the\n");
+    fprintf(stderr, "                  data file before the server is started, then exit\n");
+}
+
+int main(int argc, char *argv[]) {
+
+    const char *host = "127.0.0.1";
+    int port = PORT;
+    const char *local_path = NULL;
+    int clients = 8;
+    int connections = 100;
+    int lines = 1;
+    int depth = 1;
+    size_t line_size = 0;
+    bool incremental = false;
+    double rate = 0;
+    enum output_format format = OUTPUT_TEXT;
+    pid_t server_pid = 0;
+    const char *seed_path = NULL;
+    size_t seed_size = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:u:c:n:l:d:L:r:im:o:f:s:")) != -1) {
+        switch (opt) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'u':
+                local_path = optarg;
+                break;
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            case 'n':
+                connections = atoi(optarg);
+                break;
+            case 'l':
+                lines = atoi(optarg);
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 'L':
+                line_size = parse_size(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'i':
+                incremental = true;
+                break;
+            case 'o':
+                if (strcmp(optarg, "text") == 0) {
+                    format = OUTPUT_TEXT;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    format = OUTPUT_CSV;
+                } else if (strcmp(optarg, "json") == 0) {
+                    format = OUTPUT_JSON;
+                } else {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                server_pid = atoi(optarg);
+                break;
+            case 'f':
+                seed_path = optarg;
+                break;
+            case 's':
+                seed_size = parse_size(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (seed_path) {
+        seed_file(seed_path, seed_size);
+        return EXIT_SUCCESS;
+    }
+
+    memset(pad_chunk, 'p', sizeof(pad_chunk));
+
+    if (clients <= 0 || connections <= 0 || lines < 0 || depth <= 0 || rate < 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_storage address;
+    socklen_t addrlen;
+    memset(&address, 0, sizeof(address));
+
+    if (local_path) {
+
+        struct sockaddr_un *un = (struct sockaddr_un*)&address;
+
+        if (strlen(local_path) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "Invalid path %s\n", local_path);
+            exit(EXIT_FAILURE);
+        }
+
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, local_path);
+        addrlen = sizeof(*un);
+
+    } else {
+
+        struct sockaddr_in *in = (struct sockaddr_in*)&address;
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &in->sin_addr) != 1) {
+            fprintf(stderr, "Invalid address %s\n", host);
+            exit(EXIT_FAILURE);
+        }
+        addrlen = sizeof(*in);
+    }
+
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    struct client_params *params = calloc(clients, sizeof(struct client_params));
+    if (!threads || !params) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now();
+
+    for (int i = 0; i < clients; i++) {
+
+        params[i].id = i;
+        params[i].address = address;
+        params[i].addrlen = addrlen;
+        params[i].connections = connections;
+        params[i].lines = lines;
+        params[i].depth = depth;
+        params[i].line_size = line_size;
+        params[i].incremental = incremental;
+        params[i].rate = rate / clients;
+        params[i].start = start;
+        params[i].latencies = malloc(sizeof(double) * connections * (lines ? lines : 1));
+        if (!params[i].latencies) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pthread_create(&threads[i], NULL, client_thread, &params[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct results results = {
+        .clients = clients,
+        .connections = connections,
+        .lines = lines,
+        .depth = depth,
+        .line_size = line_size,
+        .rate = rate,
+        .peak_rss = -1,
+    };
+    size_t total = 0;
+
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        total += params[i].nlatencies;
+        results.lines_sent += params[i].lines_sent;
+        results.bytes_received += params[i].bytes_received;
+        results.recv_calls += params[i].recv_calls;
+        results.failures += params[i].failures;
+        results.errors += params[i].errors;
+    }
+
+    results.elapsed = now() - start;
+
+    // Merge the per-client samples for the percentiles
+
+    double *latencies = malloc(sizeof(double) * (total ? total : 1));
+    if (!latencies) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t n = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(&latencies[n], params[i].latencies, sizeof(double) * params[i].nlatencies);
+        n += params[i].nlatencies;
+        free(params[i].latencies);
+    }
+
+    qsort(latencies, total, sizeof(double), compare_double);
+
+    results.p50 = percentile(latencies, total, 0.50);
+    results.p99 = percentile(latencies, total, 0.99);
+    results.p999 = percentile(latencies, total, 0.999);
+    results.max = total ? latencies[total - 1] : 0;
+
+    if (server_pid > 0) {
+        results.peak_rss = read_peak_rss(server_pid);
+    }
+
+    print_results(&results, format);
+
+    free(latencies);
+    free(params);
+    free(threads);
+
+    return results.failures || results.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
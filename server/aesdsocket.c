@@ -1,24 +1,81 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <syslog.h>
-#include <arpa/inet.h>
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/queue.h>
-#include <sys/time.h>
 #include <pthread.h>
-
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "aesdsocket.h"
+#include "connection.h"
+#include "event_loop.h"
+#include "history.h"
+#include "metrics.h"
+#include "handoff.h"
 
 #define PORT 9000
+#define LINE_BUFFER_CAP (1024 * 1024)
+#define ARENA_SIZE_PARAMETER "/sys/module/aesdchar/parameters/aesd_arena_size"
+#define ARENA_SIZE_DEFAULT (1024 * 1024)
+#define POOL_QUEUE_DEPTH 128
+#define POOL_REPORT_INTERVAL 10
+#define HOUSEKEEPING_INTERVAL 1
+#define TIMESTAMP_INTERVAL 10
+#define REGISTRY_SLAB_ENTRIES 64
+#define OUTPUT_LOW_WATERMARK (256 * 1024)
+#define OUTPUT_HIGH_WATERMARK (1024 * 1024)
+#define OUTPUT_HARD_LIMIT (64 * 1024 * 1024)
+
+atomic_bool accepting = true;
+
+// Cleared along with accepting, save by a server handing over, which serves the
+// connections it has left until they close or HANDOFF_DRAIN_TIMEOUT expires
+
+atomic_bool serving = true;
+
+// Set by the signal handler for the main thread to log, as syslog is not safe there
+
+volatile sig_atomic_t signal_caught;
+
+// Listening sockets, one per shard, all bound to PORT with SO_REUSEPORT
+
+int *server_fds;
+int server_count = 1;
+int listen_backlog = SOMAXCONN;
+
+// Optional Unix stream socket served alongside, for clients on the same host
+
+char *local_path;
+int local_fd = -1;
+
+// Written once accepting is cleared, to wake up the main thread, the acceptors
+// and the event loops, then close_fd once serving is.  drained_fd wakes up the
+// main thread as the connections left after a handoff close.
 
-bool accepting = true;
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; 
+int shutdown_fd = -1;
+int close_fd = -1;
+int drained_fd = -1;
+
+// Event loops still running, the last one to exit posts drained_fd
+
+atomic_int event_loops_running;
 
 #ifdef USE_AESD_CHAR_DEVICE
 char *filename = "/dev/aesdchar";
@@ -26,211 +83,1115 @@ char *filename = "/dev/aesdchar";
 char *filename = "/var/tmp/aesdsocketdata";
 #endif
 
-struct thread_params {
+enum replay_source replay_source = REPLAY_FILE;
+
+// Answer all complete packets of a receive with a single replay
+
+bool pipelining = false;
+
+// Bytes of queued replies at which a connection stops and resumes reading packets,
+// and above which it is disconnected after OUTPUT_STALL_TIMEOUT seconds
+
+size_t output_low = OUTPUT_LOW_WATERMARK;
+size_t output_high = OUTPUT_HIGH_WATERMARK;
+size_t output_hard = OUTPUT_HARD_LIMIT;
+
+// Size the receive buffer may grow to before a partial packet is spilled to a file
+
+size_t line_cap = LINE_BUFFER_CAP;
+
+#ifdef USE_AESD_CHAR_DEVICE
+
+// Size of the aesdchar driver's arena, which fails longer commands with EFBIG, so
+// a packet longer than this is refused as soon as it is
+
+size_t packet_max = ARENA_SIZE_DEFAULT;
+#endif
+
+/**
+ * A connection served by its own thread.  Entries are carved out of slabs and
+ * recycled through the registry free list, so memory follows the peak number of
+ * concurrent connections rather than the number ever accepted.
+ */
+struct thread_entry {
+    pthread_t thread;
     int connection_fd;
-    char client_address[32];
-    bool exited;
+    struct sockaddr_storage address;
+    uint64_t accepted_at;
+    LIST_ENTRY(thread_entry) entries;
+    SLIST_ENTRY(thread_entry) next;
+};
+
+struct thread_slab {
+    SLIST_ENTRY(thread_slab) next;
+    struct thread_entry entries[REGISTRY_SLAB_ENTRIES];
+};
+
+/**
+ * Running connection threads are kept on active.  A finished thread moves its entry
+ * to completed and wakes the housekeeper, which joins it and returns the entry to
+ * the free list, so accepting and reaping are both O(1).  drained is signalled
+ * when active becomes empty.
+ */
+struct thread_registry {
+    pthread_mutex_t lock;
+    LIST_HEAD(, thread_entry) active;
+    SLIST_HEAD(, thread_entry) free;
+    SLIST_HEAD(, thread_entry) completed;
+    SLIST_HEAD(, thread_slab) slabs;
+    pthread_cond_t drained;
+};
+
+struct thread_registry registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+};
+
+struct pending_connection {
+    int connection_fd;
+    struct sockaddr_storage address;
+    struct timespec enqueued;
+};
+
+/**
+ * Bounded FIFO of accepted sockets handed from the accept loop to the worker pool.
+ * slots counts free entries and items queued ones, so producers and consumers
+ * block on a semaphore and lock only covers the ring indices and statistics.
+ * Room for one extra entry per worker is kept for the shutdown sentinels.
+ */
+struct connection_queue {
+    struct pending_connection *entries;
+    size_t size;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t active;
+    sem_t slots;
+    sem_t items;
+    pthread_mutex_t lock;
+    bool reject;
+    size_t max_depth;
+    unsigned long served;
+    unsigned long rejected;
+    unsigned long reported;
+    double wait_total;
+    double wait_max;
+};
+
+/**
+ * A pool thread and the socket it is serving, or -1 while idle.  connection_fd is
+ * only changed under the queue lock, so shutdown can wake a worker blocked on its
+ * client without racing with the close.
+ */
+struct pool_worker {
+    pthread_t thread;
+    int connection_fd;
+    struct connection_queue *queue;
+};
+
+/**
+ * Thread doing the periodic work on a timerfd ticking every HOUSEKEEPING_INTERVAL
+ * seconds: timestamps, segment retention and reporting on queue while the worker
+ * pool runs.  Finished connection threads post wake_fd to be reaped right away
+ * rather than on the next tick.  Signals only reach the main thread, so none of
+ * the others ever sees EINTR.
+ */
+struct housekeeper {
+    pthread_t thread;
+    int timer_fd;
+    int wake_fd;
+    pthread_mutex_t lock;
+    struct connection_queue *queue;
+    bool stopping;
 };
 
-struct thread_entry {
-    pthread_t thread;
-    bool joined;
-    struct thread_params *params;
-    SLIST_ENTRY(thread_entry) entries;
-};
+struct housekeeper housekeeper = {
+    .timer_fd = -1,
+    .wake_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct acceptor {
+    pthread_t thread;
+    int index;
+    int server_fd;
+    void *arg;
+};
+
+int write_line(int fd, const char *line, size_t len) {
+
+    while (len > 0) {
+        ssize_t nwrite = write(fd, line, len);
+        if (nwrite < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        line += nwrite;
+        len -= nwrite;
+    }
+
+    return 0;
+}
+
+/**
+ * Lock a mutex shared by the connections, timing the wait when it is contended.
+ */
+void mutex_lock(pthread_mutex_t *lock) {
+
+    if (!metrics.enabled) {
+        pthread_mutex_lock(lock);
+        return;
+    }
+
+    if (pthread_mutex_trylock(lock) == 0) {
+        return;
+    }
+
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(lock);
+    metrics_observe(METRIC_LOCK_WAIT, metrics_now() - start);
+}
+
+/**
+ * Post fd, an eventfd.  Safe to call from a signal handler, so errors are not
+ * reported.
+ */
+void eventfd_post(int fd) {
+
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0) {
+        // Only as the counter is about to overflow, which leaves it readable
+    }
+}
+
+/**
+ * Clear accepting and wake up everything waiting for it through shutdown_fd,
+ * which is left readable.  Safe to call from a signal handler, as is
+ * stop_serving, which does the same for serving and close_fd.
+ */
+void stop_accepting(void) {
+
+    atomic_store(&accepting, false);
+    eventfd_post(shutdown_fd);
+}
+
+static void stop_serving(void) {
+
+    atomic_store(&serving, false);
+    eventfd_post(close_fd);
+}
+
+static void signal_handler(int signo) {
+
+    if (signo == SIGINT || signo == SIGTERM) {
+        signal_caught = 1;
+        stop_accepting();
+        stop_serving();
+    }
+}
+
+/**
+ * Pin the calling thread to one CPU, spreading indexes round robin over the online
+ * CPUs.  Only done with several shards, each listener having its own thread, as a
+ * single one would leave every thread on the first CPU.
+ */
+void pin_thread(int index) {
+
+    cpu_set_t cpus;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (server_count < 2 || ncpus <= 0) {
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(index % ncpus, &cpus);
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0) {
+        errno = rc;
+        perror("pthread_setaffinity_np");
+    }
+}
+
+void block_signals(sigset_t *oldmask) {
+
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, oldmask);
+}
+
+/**
+ * Number of listening sockets, the shards followed by the Unix socket if any.
+ */
+int listener_count(void) {
+
+    return server_count + (local_fd >= 0);
+}
+
+int listener_fd(int index) {
+
+    return index < server_count ? server_fds[index] : local_fd;
+}
+
+void listeners_set_nonblocking(void) {
+
+    for (int i = 0; i < listener_count(); i++) {
+        int flags = fcntl(listener_fd(i), F_GETFL);
+        if (flags < 0 || fcntl(listener_fd(i), F_SETFL, flags | O_NONBLOCK) < 0) {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Accept the next connection on the acceptor's socket, waiting for it alongside
+ * shutdown_fd.  Returns -1 once accepting has been cleared.
+ */
+static int acceptor_accept(struct acceptor *acceptor, struct sockaddr_storage *address) {
+
+    struct pollfd fds[2] = {
+        { .fd = acceptor->server_fd, .events = POLLIN },
+        { .fd = shutdown_fd, .events = POLLIN },
+    };
+
+    while (atomic_load(&accepting)) {
+
+        socklen_t addrlen = sizeof(*address);
+        int accept_fd = accept(acceptor->server_fd, (struct sockaddr*)address, &addrlen);
+
+        if (accept_fd >= 0) {
+            return accept_fd;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+                perror("poll");
+                exit(EXIT_FAILURE);
+            }
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Start one thread running accept_loop per listening socket.  The threads, and any
+ * they create, inherit a mask that leaves signal delivery to the main thread.
+ */
+static struct acceptor *start_acceptors(void *(*accept_loop)(void*), void *arg) {
+
+    struct acceptor *acceptors = calloc(listener_count(), sizeof(struct acceptor));
+    sigset_t oldmask;
+
+    if (!acceptors) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    listeners_set_nonblocking();
+
+    block_signals(&oldmask);
+
+    for (int i = 0; i < listener_count(); i++) {
+
+        acceptors[i].index = i;
+        acceptors[i].server_fd = listener_fd(i);
+        acceptors[i].arg = arg;
+
+        if (pthread_create(&acceptors[i].thread, NULL, accept_loop, &acceptors[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    return acceptors;
+}
+
+/**
+ * Log a termination signal caught since the last call, for the main thread.
+ */
+static void log_signal(void) {
+
+    if (signal_caught) {
+        signal_caught = 0;
+        syslog(LOG_DEBUG, "Caught signal, exiting");
+    }
+}
+
+/**
+ * Sleep in the main thread until a termination signal or a new server taking
+ * over has cleared accepting, both of which write shutdown_fd.
+ */
+void wait_for_shutdown(void) {
+
+    struct pollfd fds = { .fd = shutdown_fd, .events = POLLIN };
+
+    while (poll(&fds, 1, -1) < 0) {
+        if (errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    log_signal();
+}
+
+/**
+ * Once a new server has taken over, go on serving the connections left until
+ * drained(arg), a termination signal or HANDOFF_DRAIN_TIMEOUT, whichever comes
+ * first.  Then clear serving, for the rest to be closed.
+ */
+void wait_for_drain(bool (*drained)(void *arg), void *arg) {
+
+    struct pollfd fds[2] = {
+        { .fd = drained_fd, .events = POLLIN },
+        { .fd = close_fd, .events = POLLIN },
+    };
+    struct timespec deadline, now;
+    uint64_t count;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += HANDOFF_DRAIN_TIMEOUT;
+
+    while (handoff.next_fd >= 0 && atomic_load(&serving) && !drained(arg)) {
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long timeout = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+        if (timeout <= 0) {
+            syslog(LOG_INFO, "Closing the connections left after handing over");
+            break;
+        }
+
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (read(drained_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("read");
+        }
+    }
+
+    log_signal();
+    stop_serving();
+}
+
+/**
+ * Wait for the acceptor threads, which return once shutdown_fd wakes them up.
+ * Their sockets are left listening, for a new server taking over.
+ */
+static void stop_acceptors(struct acceptor *acceptors) {
+
+    for (int i = 0; i < listener_count(); i++) {
+        if (pthread_join(acceptors[i].thread, NULL) != 0) {
+            perror("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(acceptors);
+}
+
+static void housekeeper_wake(void) {
+
+    uint64_t one = 1;
+
+    if (write(housekeeper.wake_fd, &one, sizeof(one)) < 0) {
+        perror("write");
+    }
+}
+
+/**
+ * Take an entry from the free list, growing it by a slab when empty, and add it to
+ * the active list.
+ * @return the entry, or NULL if memory could not be allocated
+ */
+static struct thread_entry *registry_alloc(int connection_fd, struct sockaddr_storage *address) {
+
+    mutex_lock(&registry.lock);
+
+    if (SLIST_EMPTY(&registry.free)) {
+
+        struct thread_slab *slab = calloc(1, sizeof(struct thread_slab));
+        if (!slab) {
+            pthread_mutex_unlock(&registry.lock);
+            perror("calloc");
+            return NULL;
+        }
+
+        SLIST_INSERT_HEAD(&registry.slabs, slab, next);
+        for (int i = 0; i < REGISTRY_SLAB_ENTRIES; i++) {
+            SLIST_INSERT_HEAD(&registry.free, &slab->entries[i], next);
+        }
+    }
+
+    struct thread_entry *entry = SLIST_FIRST(&registry.free);
+    SLIST_REMOVE_HEAD(&registry.free, next);
+
+    entry->connection_fd = connection_fd;
+    entry->address = *address;
+    entry->accepted_at = metrics_now();
+    LIST_INSERT_HEAD(&registry.active, entry, entries);
+
+    pthread_mutex_unlock(&registry.lock);
+
+    return entry;
+}
+
+static void registry_release(struct thread_entry *entry) {
+
+    mutex_lock(&registry.lock);
+    LIST_REMOVE(entry, entries);
+    SLIST_INSERT_HEAD(&registry.free, entry, next);
+    pthread_mutex_unlock(&registry.lock);
+}
+
+void *connection_thread(void *arg) {
+
+    struct thread_entry *entry = (struct thread_entry*)arg;
+    int connection_fd = entry->connection_fd;
+    struct connection *conn = connection_create(connection_fd, &entry->address);
+
+    if (conn) {
+
+        conn->accepted_at = entry->accepted_at;
+
+        // The socket is blocking, so this only returns once the client is done
+
+        connection_run(conn);
+    }
+
+    // Forget the socket before it is closed, so shutdown can't reach a reused fd
+
+    mutex_lock(&registry.lock);
+    entry->connection_fd = -1;
+    pthread_mutex_unlock(&registry.lock);
+
+    if (conn) {
+        connection_destroy(conn);
+    } else {
+        close(connection_fd);
+    }
+
+    mutex_lock(&registry.lock);
+    entry->thread = pthread_self();
+    SLIST_INSERT_HEAD(&registry.completed, entry, next);
+    pthread_mutex_unlock(&registry.lock);
+
+    housekeeper_wake();
+
+    return NULL;
+}
+
+/**
+ * Join the connection threads that have finished and return their entries to the
+ * free list, signalling drained once no thread is left, and posting drained_fd
+ * as well after accepting has stopped.
+ */
+static void registry_reap(void) {
+
+    mutex_lock(&registry.lock);
+    struct thread_entry *completed = SLIST_FIRST(&registry.completed);
+    SLIST_INIT(&registry.completed);
+    pthread_mutex_unlock(&registry.lock);
+
+    while (completed) {
+
+        struct thread_entry *entry = completed;
+        completed = SLIST_NEXT(entry, next);
+
+        if (pthread_join(entry->thread, NULL) != 0) {
+            perror("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+        registry_release(entry);
+    }
+
+    mutex_lock(&registry.lock);
+    if (LIST_EMPTY(&registry.active)) {
+        pthread_cond_broadcast(&registry.drained);
+        if (!atomic_load(&accepting)) {
+            eventfd_post(drained_fd);
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+static bool registry_drained(void *arg) {
+
+    mutex_lock(&registry.lock);
+    bool drained = LIST_EMPTY(&registry.active);
+    pthread_mutex_unlock(&registry.lock);
+
+    return drained;
+}
+
+void *connection_acceptor(void *arg) {
+
+    struct acceptor *acceptor = (struct acceptor*)arg;
+
+    pin_thread(acceptor->index);
+
+    int accept_fd;
+    struct sockaddr_storage address;
+
+    while ((accept_fd = acceptor_accept(acceptor, &address)) >= 0) {
+
+        pthread_t thread;
+        struct thread_entry *entry = registry_alloc(accept_fd, &address);
+        if (!entry) {
+            close(accept_fd);
+            continue;
+        }
+
+        if (pthread_create(&thread, NULL, connection_thread, entry) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return acceptor;
+}
+
+/**
+ * Serve every connection from its own thread until a termination signal arrives,
+ * or a new server takes over and those left are drained, then close the
+ * remaining client sockets and wait for their threads.
+ */
+void run_connection_threads(void) {
+
+    struct acceptor *acceptors = start_acceptors(connection_acceptor, NULL);
+
+    wait_for_shutdown();
+
+    stop_acceptors(acceptors);
+
+    wait_for_drain(registry_drained, NULL);
+
+    // Wake up threads still blocked on their clients, then wait for the housekeeper
+    // to reap them all
+
+    mutex_lock(&registry.lock);
+
+    struct thread_entry *entry;
+    LIST_FOREACH(entry, &registry.active, entries) {
+        if (entry->connection_fd >= 0) {
+            shutdown(entry->connection_fd, SHUT_RDWR);
+        }
+    }
+
+    while (!LIST_EMPTY(&registry.active)) {
+        pthread_cond_wait(&registry.drained, &registry.lock);
+    }
+
+    pthread_mutex_unlock(&registry.lock);
+
+    // Free the slabs
+
+    while (!SLIST_EMPTY(&registry.slabs)) {
+        struct thread_slab *slab = SLIST_FIRST(&registry.slabs);
+        SLIST_REMOVE_HEAD(&registry.slabs, next);
+        free(slab);
+    }
+
+    SLIST_INIT(&registry.free);
+}
+
+static double elapsed_since(const struct timespec *start) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Log the queue statistics, the caller must hold queue->lock.  The housekeeper
+ * does so every POOL_REPORT_INTERVAL seconds while connections are coming in.
+ */
+static void connection_queue_report(struct connection_queue *queue) {
+
+    double wait_avg = queue->served ? queue->wait_total / queue->served : 0;
+
+    syslog(LOG_INFO, "Worker pool queue depth %zu/%zu (max %zu), %lu served, %lu rejected, "
+            "wait avg %.0f us max %.0f us", queue->count, queue->capacity, queue->max_depth,
+            queue->served, queue->rejected, wait_avg * 1e6, queue->wait_max * 1e6);
+
+    queue->reported = queue->served + queue->rejected;
+}
+
+/**
+ * Queue an accepted socket, the caller must already own one of queue->slots
+ * unless connection_fd is a -1 shutdown sentinel.
+ */
+static void connection_queue_push(struct connection_queue *queue, int connection_fd,
+        struct sockaddr_storage *address) {
+
+    mutex_lock(&queue->lock);
+
+    struct pending_connection *pending = &queue->entries[(queue->head + queue->count) % queue->size];
+    pending->connection_fd = connection_fd;
+    if (address) {
+        pending->address = *address;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pending->enqueued);
+
+    queue->count++;
+    if (connection_fd >= 0 && queue->count > queue->max_depth) {
+        queue->max_depth = queue->count;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    sem_post(&queue->items);
+}
+
+/**
+ * Take the oldest entry off the queue, blocking until there is one unless nowait is set.
+ * @return 0 on success, -1 if nowait is set and the queue is empty
+ */
+static int connection_queue_pop(struct connection_queue *queue, struct pending_connection *pending,
+        bool nowait) {
+
+    while ((nowait ? sem_trywait(&queue->items) : sem_wait(&queue->items)) < 0) {
+        if (errno == EAGAIN) {
+            return -1;
+        }
+        if (errno != EINTR) {
+            perror("sem_wait");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    mutex_lock(&queue->lock);
+
+    *pending = queue->entries[queue->head];
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+
+    if (pending->connection_fd >= 0) {
+
+        double wait = elapsed_since(&pending->enqueued);
+
+        queue->active++;
+        queue->served++;
+        queue->wait_total += wait;
+        if (wait > queue->wait_max) {
+            queue->wait_max = wait;
+        }
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    if (pending->connection_fd >= 0) {
+        sem_post(&queue->slots);
+    }
+
+    return 0;
+}
+
+/**
+ * Count a connection taken from the queue as done, waking up the main thread once
+ * none is left after accepting has stopped.  Called with the queue lock held.
+ */
+static void connection_queue_done(struct connection_queue *queue) {
+
+    if (--queue->active == 0 && queue->count == 0 && !atomic_load(&accepting)) {
+        eventfd_post(drained_fd);
+    }
+}
+
+static bool connection_queue_drained(void *arg) {
+
+    struct connection_queue *queue = (struct connection_queue*)arg;
+
+    mutex_lock(&queue->lock);
+    bool drained = queue->active == 0 && queue->count == 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    return drained;
+}
+
+void *worker_thread(void *arg) {
+
+    struct pool_worker *worker = (struct pool_worker*)arg;
+    struct connection_queue *queue = worker->queue;
+    struct pending_connection pending;
+
+    while (true) {
+
+        connection_queue_pop(queue, &pending, false);
+
+        if (pending.connection_fd < 0) {
+            break;
+        }
+
+        struct connection *conn = connection_create(pending.connection_fd, &pending.address);
+        if (!conn) {
+            close(pending.connection_fd);
+            mutex_lock(&queue->lock);
+            connection_queue_done(queue);
+            pthread_mutex_unlock(&queue->lock);
+            continue;
+        }
+
+        // Time spent queued counts towards the first byte
+
+        if (conn->accepted_at) {
+            conn->accepted_at = (uint64_t)pending.enqueued.tv_sec * 1000000000 + pending.enqueued.tv_nsec;
+        }
+
+        mutex_lock(&queue->lock);
+        worker->connection_fd = pending.connection_fd;
+        if (!atomic_load(&serving)) {
+            shutdown(worker->connection_fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        connection_run(conn);
+
+        mutex_lock(&queue->lock);
+        worker->connection_fd = -1;
+        connection_queue_done(queue);
+        pthread_mutex_unlock(&queue->lock);
+
+        connection_destroy(conn);
+    }
+
+    return worker;
+}
+
+void *pool_acceptor(void *arg) {
+
+    struct acceptor *acceptor = (struct acceptor*)arg;
+    struct connection_queue *queue = (struct connection_queue*)acceptor->arg;
+    bool have_slot = false;
+
+    pin_thread(acceptor->index);
+
+    while (atomic_load(&accepting)) {
+
+        int accept_fd;
+        struct sockaddr_storage address;
+
+        if (!queue->reject && !have_slot) {
+            if (sem_wait(&queue->slots) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("sem_wait");
+                exit(EXIT_FAILURE);
+            }
+            have_slot = true;
+        }
+
+        if ((accept_fd = acceptor_accept(acceptor, &address)) < 0) {
+            break;
+        }
+
+        if (queue->reject && sem_trywait(&queue->slots) < 0) {
+
+            mutex_lock(&queue->lock);
+            queue->rejected++;
+            pthread_mutex_unlock(&queue->lock);
+
+            char client_address[INET_ADDRSTRLEN];
+            format_peer(accept_fd, &address, client_address, sizeof(client_address));
+            syslog(LOG_DEBUG, "Rejected connection from %s, queue full", client_address);
+            close(accept_fd);
+            continue;
+        }
+
+        have_slot = false;
+        connection_queue_push(queue, accept_fd, &address);
+    }
+
+    return acceptor;
+}
+
+/**
+ * Serve all connections from a fixed pool of nworkers threads fed through a queue
+ * of at most capacity accepted sockets.  When the queue is full the acceptors
+ * either wait for a free slot, leaving new connections in the listen backlog,
+ * or with reject set accept and immediately close them.
+ */
+void run_worker_pool(int nworkers, size_t capacity, bool reject) {
+
+    struct connection_queue queue;
+    struct pool_worker *workers = calloc(nworkers, sizeof(struct pool_worker));
+    sigset_t oldmask;
+
+    memset(&queue, 0, sizeof(queue));
+    queue.capacity = capacity;
+    queue.size = capacity + nworkers;
+    queue.entries = calloc(queue.size, sizeof(struct pending_connection));
+    queue.reject = reject;
+
+    if (!workers || !queue.entries) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sem_init(&queue.slots, 0, capacity) < 0 || sem_init(&queue.items, 0, 0) < 0) {
+        perror("sem_init");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&queue.lock, NULL);
+
+    block_signals(&oldmask);
+
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].connection_fd = -1;
+        workers[i].queue = &queue;
+
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    struct acceptor *acceptors = start_acceptors(pool_acceptor, &queue);
+
+    pthread_mutex_lock(&housekeeper.lock);
+    housekeeper.queue = &queue;
+    pthread_mutex_unlock(&housekeeper.lock);
 
-SLIST_HEAD(thread_list, thread_entry) threads;
+    wait_for_shutdown();
 
-static void signal_handler(int signo) {
+    pthread_mutex_lock(&housekeeper.lock);
+    housekeeper.queue = NULL;
+    pthread_mutex_unlock(&housekeeper.lock);
 
-    if (signo == SIGINT || signo == SIGTERM) {
+    // Acceptors waiting for a queue slot are released before their sockets are shut down
 
-        accepting = false;
-        syslog(LOG_DEBUG, "Caught signal, exiting");
+    for (int i = 0; i < listener_count(); i++) {
+        sem_post(&queue.slots);
+    }
 
-    } else if (signo == SIGALRM) {
+    stop_acceptors(acceptors);
 
-        char outstr[200];
-        time_t t;
-        struct tm *tmp;
+    wait_for_drain(connection_queue_drained, &queue);
 
-        t = time(NULL);
-        tmp = localtime(&t);
-        if (tmp == NULL) {
-            perror("localtime");
-            exit(EXIT_FAILURE);
-        }
+    // Wake up workers blocked on their clients, close connections no worker has
+    // picked up yet, then stop the workers
 
-        if (strftime(outstr, sizeof(outstr), "timestamp: %F %T\n", tmp) == 0) {
-            perror("strftime");
-            exit(EXIT_FAILURE);
+    mutex_lock(&queue.lock);
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i].connection_fd >= 0) {
+            shutdown(workers[i].connection_fd, SHUT_RDWR);
         }
+    }
+    pthread_mutex_unlock(&queue.lock);
+
+    struct pending_connection pending;
+    while (connection_queue_pop(&queue, &pending, true) == 0) {
+        close(pending.connection_fd);
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        connection_queue_push(&queue, -1, NULL);
+    }
 
-        FILE *file = fopen(filename, "a+");
-        if (!file) {
-            perror("fopen");
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_join(workers[i].thread, NULL) != 0) {
+            perror("pthread_join");
             exit(EXIT_FAILURE);
         }
+    }
 
-        pthread_mutex_lock(&file_mutex);
-        fputs(outstr, file);
-        pthread_mutex_unlock(&file_mutex);
+    connection_queue_report(&queue);
 
-        fclose(file);
-    }
+    pthread_mutex_destroy(&queue.lock);
+    sem_destroy(&queue.items);
+    sem_destroy(&queue.slots);
+    free(queue.entries);
+    free(workers);
 }
 
-void *connection_thread(void *tp) {
-
-    size_t buffer_size = 1024;
-    char *buffer = malloc(buffer_size);
-    size_t buffer_len = 0;
-    ssize_t nread;
-    char *file_line = NULL;
-    size_t file_line_len = 0;
-    struct thread_params *params = (struct thread_params*)tp;
+/**
+ * Whether a period of interval seconds ended within the last expirations ticks.
+ */
+static bool housekeeper_due(unsigned long ticks, uint64_t expirations, int interval) {
 
-    FILE *file = fopen(filename, "a+");
-    if (!file) {
-        perror("fopen");
-        exit(EXIT_FAILURE);
-    }
+    unsigned long period = interval / HOUSEKEEPING_INTERVAL;
 
-    syslog(LOG_DEBUG, "Accepted connection from %s", params->client_address);
+    return ticks / period != (ticks - expirations) / period;
+}
 
-    while ((nread = recv(params->connection_fd, (void*)&buffer[buffer_len], buffer_size - buffer_len, 0)) != 0) {
+/**
+ * Run the periodic work for expirations ticks of the timer.  Ticks missed while
+ * busy still count towards the intervals, but each job runs once.
+ */
+static void housekeeper_tick(unsigned long ticks, uint64_t expirations) {
 
-        if (nread == -1) {
-            if (errno == EINTR) {
-                if (!accepting) {
-                    break;
-                } else {
-                    continue;
-                }
-            }
-            perror("recv");
-            break;
-        }
+#ifndef USE_AESD_CHAR_DEVICE
 
-        buffer_len += nread;
+    // A history handed over is left to the new server
 
-        // Process all available messages in buffer
+    if (handoff.next_fd < 0 && housekeeper_due(ticks, expirations, TIMESTAMP_INTERVAL)) {
+        history_timestamp();
+    }
 
-        char *line_start = buffer;
-        char *line_end;
-        while ((line_end = (char*)memchr((void*)line_start, '\n', buffer_len - (line_start - buffer)))) {
+    if (handoff.next_fd < 0 && (segment_log.retain_bytes || segment_log.retain_age)) {
+        segment_retain();
+    }
+#endif
 
-            *line_end = '\0';
+    pthread_mutex_lock(&housekeeper.lock);
 
-#ifdef USE_AESD_CHAR_DEVICE
+    struct connection_queue *queue = housekeeper.queue;
 
-            if (strncmp(line_start, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0) {
+    if (queue && housekeeper_due(ticks, expirations, POOL_REPORT_INTERVAL)) {
+        mutex_lock(&queue->lock);
+        if (queue->served + queue->rejected != queue->reported) {
+            connection_queue_report(queue);
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
 
-                struct aesd_seekto seekto;
-                unsigned int write_cmd, write_cmd_offset;
+    pthread_mutex_unlock(&housekeeper.lock);
+}
 
-                sscanf(line_start, "AESDCHAR_IOCSEEKTO:%u,%u", &write_cmd, &write_cmd_offset);
+void *housekeeper_thread(void *arg) {
 
-                seekto.write_cmd = write_cmd;
-                seekto.write_cmd_offset = write_cmd_offset;
+    struct pollfd fds[3] = {
+        { .fd = housekeeper.timer_fd, .events = POLLIN },
+        { .fd = housekeeper.wake_fd, .events = POLLIN },
+        { .fd = handoff.server_fd, .events = POLLIN },
+    };
+    unsigned long ticks = 0;
+    bool stopping = false;
 
-                if (ioctl(fileno(file), AESDCHAR_IOCSEEKTO, &seekto) < 0) {
-                    perror("ioctl");
-                    goto cleanup;
-                }
+    while (!stopping) {
 
-            } else {
+        uint64_t count;
 
-                fputs(line_start, file);
-                fputc('\n', file);
+        if (poll(fds, 3, -1) < 0) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
 
-                fseek(file, 0, SEEK_SET);
+        if (fds[2].revents & POLLIN) {
+            handoff_accept();
+            if (handoff.next_fd >= 0) {
+                fds[2].fd = -1;
             }
-#else
-
-            pthread_mutex_lock(&file_mutex);
+        }
 
-            fputs(line_start, file);
-            fputc('\n', file);
+        if (fds[0].revents & POLLIN) {
+            if (read(housekeeper.timer_fd, &count, sizeof(count)) == sizeof(count)) {
+                ticks += count;
+                housekeeper_tick(ticks, count);
+            }
+        }
 
-            pthread_mutex_unlock(&file_mutex);
+        if (fds[1].revents & POLLIN) {
 
-            // Seek to beginning of file
+            if (read(housekeeper.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("read");
+            }
 
-            fseek(file, 0, SEEK_SET);
-#endif
+            registry_reap();
 
-            line_start = line_end + 1;
-
-            // Read one line at a time and send back to client
-
-            while ((nread = getline(&file_line, &file_line_len, file)) != -1) {
-                ssize_t nsend = send(params->connection_fd, file_line, nread, 0);
-                if (nsend == -1) {
-                    if (errno == EINTR) {
-                        if (!accepting) {
-                            break;
-                        } else {
-                            continue;
-                        }
-                    }
-                    perror("send");
-                    goto cleanup;
-                } else if (nsend == 0) {
-                    goto cleanup;
-                }
-            }
+            pthread_mutex_lock(&housekeeper.lock);
+            stopping = housekeeper.stopping;
+            pthread_mutex_unlock(&housekeeper.lock);
         }
+    }
 
-        // Shift unprocessed data to start of buffer
+    return arg;
+}
 
-        if (line_start != buffer) {
-            buffer_len -= (line_start - buffer);
-            memmove(buffer, line_start, buffer_len);
-        }
+/**
+ * Start the housekeeper, with the first tick HOUSEKEEPING_INTERVAL seconds from now.
+ */
+static void housekeeper_start(void) {
 
-        // Increase buffer size and reallocate if buffer is full
+    struct itimerspec interval = {
+        .it_interval.tv_sec = HOUSEKEEPING_INTERVAL,
+        .it_value.tv_sec = HOUSEKEEPING_INTERVAL,
+    };
+    sigset_t oldmask;
 
-        if (buffer_len == buffer_size) {
+    if ((housekeeper.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+
+    if (timerfd_settime(housekeeper.timer_fd, 0, &interval, NULL) < 0) {
+        perror("timerfd_settime");
+        exit(EXIT_FAILURE);
+    }
 
-            buffer_size *= 2;
+    if ((housekeeper.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
 
-            char *new_buffer = realloc(buffer, buffer_size);
-            if (!new_buffer) {
-                perror("realloc");
-                break;
-            }
+    block_signals(&oldmask);
 
-            buffer = new_buffer;
-        }
+    if (pthread_create(&housekeeper.thread, NULL, housekeeper_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
     }
 
-cleanup:
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+/**
+ * Stop the housekeeper once no connection is left for it to reap.
+ */
+static void housekeeper_stop(void) {
 
-    free(buffer);
-    free(file_line);
-    fclose(file);
-    close(params->connection_fd);
+    pthread_mutex_lock(&housekeeper.lock);
+    housekeeper.stopping = true;
+    pthread_mutex_unlock(&housekeeper.lock);
 
-    syslog(LOG_DEBUG, "Closed connection from %s", params->client_address);
+    housekeeper_wake();
 
-    params->exited = true;
+    if (pthread_join(housekeeper.thread, NULL) != 0) {
+        perror("pthread_join");
+        exit(EXIT_FAILURE);
+    }
 
-    return params;
+    close(housekeeper.timer_fd);
+    close(housekeeper.wake_fd);
 }
 
-int setup_server(bool daemonize) {
+static int open_server(void) {
 
     int server_fd;
     int opt = 1;
     struct sockaddr_in address;
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
 
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
@@ -244,6 +1205,78 @@ int setup_server(bool daemonize) {
         exit(EXIT_FAILURE);
     }
 
+    return server_fd;
+}
+
+void unix_address(struct sockaddr_un *address, const char *path) {
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Unix socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+
+    strcpy(address->sun_path, path);
+}
+
+/**
+ * Bind a Unix stream socket at path, replacing a socket left behind.
+ */
+static int open_unix_server(const char *path) {
+
+    int server_fd;
+    struct sockaddr_un address;
+
+    unix_address(&address, path);
+
+    if ((server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (unlink(path) < 0 && errno != ENOENT) {
+        perror("unlink");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    return server_fd;
+}
+
+/**
+ * Open server_count listening sockets on PORT.  With more than one the kernel
+ * spreads incoming connections across them through SO_REUSEPORT.  The Unix
+ * socket, if any, is opened as well, unless they were handed over, and with -H
+ * the socket a future server connects to for taking over.
+ */
+void setup_server(bool daemonize) {
+
+    if (!server_fds) {
+
+        if (!(server_fds = calloc(server_count, sizeof(int)))) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < server_count; i++) {
+            server_fds[i] = open_server();
+        }
+    }
+
+    if (local_path && local_fd < 0) {
+        local_fd = open_unix_server(local_path);
+    }
+
+    if (handoff.path) {
+        handoff.server_fd = open_unix_server(handoff.path);
+    }
+
     if (daemonize) {
         if (daemon(0, 0) < 0) {
             perror("daemon");
@@ -251,24 +1284,33 @@ int setup_server(bool daemonize) {
         }
     }
 
-    if ((listen(server_fd, 5)) < 0) {
+    for (int i = 0; i < listener_count(); i++) {
+        if ((listen(listener_fd(i), listen_backlog)) < 0) {
+            perror("listen");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (handoff.server_fd >= 0 && listen(handoff.server_fd, 1) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
-
-    return server_fd;
 }
 
 void setup_signals() {
 
-#ifndef USE_AESD_CHAR_DEVICE
-    struct itimerval delay;
-#endif
     struct sigaction a;
     a.sa_handler = signal_handler;
     a.sa_flags = 0;
     sigemptyset(&a.sa_mask);
 
+    if ((shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+            (close_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+            (drained_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
     if (sigaction(SIGINT, &a, NULL) < 0) {
         perror("sigaction");
         exit(EXIT_FAILURE);
@@ -279,121 +1321,349 @@ void setup_signals() {
         exit(EXIT_FAILURE);
     }
 
-#ifndef USE_AESD_CHAR_DEVICE
-    if (sigaction(SIGALRM, &a, NULL) < 0) {
+    // sendfile has no MSG_NOSIGNAL, a client gone mid replay must only fail it with EPIPE
+
+    a.sa_handler = SIG_IGN;
+
+    if (sigaction(SIGPIPE, &a, NULL) < 0) {
         perror("sigaction");
         exit(EXIT_FAILURE);
     }
+}
 
-    delay.it_value.tv_sec = 10;
-    delay.it_value.tv_usec = 0;
-    delay.it_interval.tv_sec = 10;
-    delay.it_interval.tv_usec = 0;
+#ifdef USE_AESD_CHAR_DEVICE
 
-    if (setitimer(ITIMER_REAL, &delay, NULL) < 0) {
-        perror("setitimer");
-        exit(EXIT_FAILURE);
+/**
+ * Read the arena size the aesdchar module was loaded with into packet_max, keeping
+ * its default when the module parameters cannot be read.
+ */
+static void packet_max_load(void) {
+
+    unsigned long long size;
+
+    FILE *file = fopen(ARENA_SIZE_PARAMETER, "re");
+    if (!file) {
+        return;
+    }
+
+    if (fscanf(file, "%llu", &size) == 1 && size > 0) {
+        packet_max = size;
     }
+
+    fclose(file);
+}
+#endif
+
+static void usage(const char *prog) {
+
+    fprintf(stderr, "Usage: %s [-d] [-e loops | -w workers [-q depth] [-R]] [-s shards] [-b backlog]\n"
+            "       [-o low:high:hard] [-m bytes] [-p] [-r source] [-g sync]\n"
+            "       [-S bytes [-K bytes] [-A seconds]] [-u path] [-M port | -M path] [-H path [-U]]\n", prog);
+    fprintf(stderr, "  -d         run as a daemon\n");
+#ifdef USE_IO_URING
+    fprintf(stderr, "  -e loops   serve connections from this many io_uring event loop threads\n");
+#else
+    fprintf(stderr, "  -e loops   serve connections from this many epoll event loop threads\n");
+#endif
+    fprintf(stderr, "             instead of one thread per connection\n");
+    fprintf(stderr, "  -w workers serve connections from a fixed pool of worker threads\n");
+    fprintf(stderr, "  -q depth   accepted connections queued for the pool (default %d)\n", POOL_QUEUE_DEPTH);
+    fprintf(stderr, "  -R         reject connections while the queue is full instead of\n");
+    fprintf(stderr, "             leaving them in the listen backlog\n");
+    fprintf(stderr, "  -s shards  open this many listening sockets (0 for one per CPU), each\n");
+    fprintf(stderr, "             served by its own acceptor or event loop pinned to a CPU\n");
+    fprintf(stderr, "             when there are several\n");
+    fprintf(stderr, "  -b backlog listen backlog of each socket (default %d)\n", SOMAXCONN);
+    fprintf(stderr, "  -u path    also serve clients on the same host on a Unix stream socket\n");
+#ifndef USE_AESD_CHAR_DEVICE
+    fprintf(stderr, "  -o low:high:hard\n");
+    fprintf(stderr, "             bytes of queued replies at which a client's packets stop and\n");
+    fprintf(stderr, "             resume being read, and over which it is disconnected after\n");
+    fprintf(stderr, "             %d s (default %d:%d:%d)\n", OUTPUT_STALL_TIMEOUT,
+            OUTPUT_LOW_WATERMARK, OUTPUT_HIGH_WATERMARK, OUTPUT_HARD_LIMIT);
 #endif
+    fprintf(stderr, "  -m bytes   size a packet may reach in memory before the rest of it is\n");
+    fprintf(stderr, "             spilled to a temporary file (default %d)\n", LINE_BUFFER_CAP);
+#ifdef USE_AESD_CHAR_DEVICE
+    fprintf(stderr, "             packets over the aesdchar module's aesd_arena_size (default\n");
+    fprintf(stderr, "             %d) cannot be stored and close their connection\n", ARENA_SIZE_DEFAULT);
+#endif
+    fprintf(stderr, "  -p         pipelining, answer all complete packets received together with\n");
+    fprintf(stderr, "             a single replay instead of one replay each\n");
+    fprintf(stderr, "  -r source  replay history with one of:\n");
+    fprintf(stderr, "               file      reads of the data file (default)\n");
+    fprintf(stderr, "               sendfile  sendfile from the data file, where it supports it\n");
+#ifndef USE_AESD_CHAR_DEVICE
+    fprintf(stderr, "               memory    a shared in-memory copy of the data file\n");
+    fprintf(stderr, "               mmap      an mmap of the data file\n");
+    fprintf(stderr, "  -g sync    append lines from a single commit thread, batching\n");
+    fprintf(stderr, "             concurrent writers into one write, then fdatasync \"none\",\n");
+    fprintf(stderr, "             after every \"batch\" or at most every N ms\n");
+    fprintf(stderr, "  -S bytes   keep the history in segments of this size listed in a\n");
+    fprintf(stderr, "             manifest, kept across restarts\n");
+    fprintf(stderr, "  -K bytes   drop the oldest segments while the history after them\n");
+    fprintf(stderr, "             exceeds this size\n");
+    fprintf(stderr, "  -A seconds drop segments last written longer ago than this\n");
+#endif
+    fprintf(stderr, "  -M port    serve metrics in the Prometheus text format on this port of\n");
+    fprintf(stderr, "  -M path    the loopback interface, or on a Unix socket at this path\n");
+    fprintf(stderr, "  -H path    take over the sockets and history of the server listening\n");
+    fprintf(stderr, "             for a successor at this path, if any, then listen there\n");
+    fprintf(stderr, "  -U         exit with a failure, before -d detaches, if no server hands over\n");
 }
 
 int main(int argc, char *argv[]) {
 
     bool daemonize = false;
-    int server_fd;
+    int event_loops = 0;
+    int workers = 0;
+    int queue_depth = POOL_QUEUE_DEPTH;
+    bool reject = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "de:r:w:q:Rs:b:u:H:Ug:po:m:S:K:A:M:")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemonize = true;
+                break;
+            case 'e':
+                event_loops = atoi(optarg);
+                if (event_loops <= 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if (workers <= 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                if (queue_depth <= 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                reject = true;
+                break;
+            case 's':
+                server_count = atoi(optarg);
+                if (server_count <= 0) {
+                    server_count = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                if (server_count <= 0) {
+                    server_count = 1;
+                }
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                if (listen_backlog <= 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'u':
+                local_path = optarg;
+                break;
+            case 'H':
+                handoff.path = optarg;
+                break;
+            case 'U':
+                handoff.required = true;
+                break;
+            case 'p':
+                pipelining = true;
+                break;
+            case 'M':
+                metrics.enabled = true;
+                metrics.address = optarg;
+                break;
+            case 'm':
+                line_cap = strtoull(optarg, NULL, 10);
+                if (line_cap < RECV_BUFFER_SIZE) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                if (strcmp(optarg, "file") == 0) {
+                    replay_source = REPLAY_FILE;
+                } else if (strcmp(optarg, "sendfile") == 0) {
+                    replay_source = REPLAY_SENDFILE;
+#ifndef USE_AESD_CHAR_DEVICE
+                } else if (strcmp(optarg, "memory") == 0) {
+                    replay_source = REPLAY_MEMORY;
+                } else if (strcmp(optarg, "mmap") == 0) {
+                    replay_source = REPLAY_MMAP;
+#endif
+                } else {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+#ifndef USE_AESD_CHAR_DEVICE
+            case 'o':
+                if (sscanf(optarg, "%zu:%zu:%zu", &output_low, &output_high, &output_hard) != 3 ||
+                        output_low > output_high || output_high > output_hard) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'g':
+                commit_log.enabled = true;
+                if (strcmp(optarg, "none") == 0) {
+                    commit_log.sync_policy = SYNC_NONE;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    commit_log.sync_policy = SYNC_BATCH;
+                } else if ((commit_log.sync_interval = atoi(optarg)) > 0) {
+                    commit_log.sync_policy = SYNC_INTERVAL;
+                } else {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                segment_log.enabled = true;
+                segment_log.size = strtoull(optarg, NULL, 10);
+                if (segment_log.size == 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'K':
+                segment_log.retain_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'A':
+                segment_log.retain_age = atol(optarg);
+                break;
+#endif
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
 
-    if ((argc > 1) && (0 == strcmp(argv[1], "-d"))) {
-        daemonize = true;
+    if ((event_loops > 0 && workers > 0) || (handoff.required && !handoff.path)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
     }
 
-    openlog("aesdsocket", 0, LOG_USER);
+#ifndef USE_AESD_CHAR_DEVICE
 
-    server_fd = setup_server(daemonize);       
+    // The memlog is the whole history, and mapped segments stay mapped, neither can
+    // drop segments under a replay
 
-    setup_signals();
+    if ((segment_log.retain_bytes || segment_log.retain_age) &&
+            (!segment_log.enabled || replay_source == REPLAY_MEMORY ||
+             replay_source == REPLAY_MMAP)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+#endif
 
-    SLIST_INIT(&threads);
+    openlog("aesdsocket", 0, LOG_USER);
 
-    while (accepting) {
+#ifdef USE_AESD_CHAR_DEVICE
+    packet_max_load();
 
-        int accept_fd;
-        pthread_t thread;
-        struct sockaddr_in address;
-        int addrlen = sizeof(struct sockaddr_in);
+    // Packets received together are written one by one, none may be over the limit
 
-        if ((accept_fd = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen)) < 0) {
-            if (errno == EINTR) {
-                if (!accepting) {
-                    break;
-                } else {
-                    continue;
-                }
-            }
-            perror("accept");
-            exit(EXIT_FAILURE);
-        }
+    if (line_cap > packet_max && packet_max >= RECV_BUFFER_SIZE) {
+        line_cap = packet_max;
+    }
+#endif
 
-        struct thread_params *params = malloc(sizeof(struct thread_params));
-        params->connection_fd = accept_fd;
-        strncpy(params->client_address, inet_ntoa(address.sin_addr), 16);
-        params->exited = false;
+    if (handoff.path) {
+        handoff_receive();
+    }
 
-        if (pthread_create(&thread, NULL, connection_thread, params) < 0) {
-            perror("pthread_create");
-            exit(EXIT_FAILURE);
-        }
+    // The listening sockets are only there already if handed over
+
+    if (handoff.required && !server_fds) {
+        fprintf(stderr, "%s: not taking over, exiting\n", handoff.path);
+        exit(EXIT_FAILURE);
+    }
 
-        struct thread_entry *new_thread = malloc(sizeof(struct thread_entry));
-        new_thread->thread = thread;
-        new_thread->joined = false;
-        new_thread->params = params;
+    if (metrics.enabled) {
+        metrics_open();
+    }
 
-        SLIST_INSERT_HEAD(&threads, new_thread, entries);
+    setup_server(daemonize);
 
-        // Join threads that have exited
+#ifndef USE_AESD_CHAR_DEVICE
+    history_load();
+    append_log_open();
+#endif
 
-        struct thread_entry *curr = NULL;
-        SLIST_FOREACH(curr, &threads, entries) {
-            if (!curr->joined && curr->params->exited) {
-                if (pthread_join(curr->thread, NULL) < 0) {
-                    perror("pthread_join");
-                    exit(EXIT_FAILURE);
-                }
-                curr->joined = true;
-                free(curr->params);
-            }
-        }
+    setup_signals();
+
+#ifndef USE_AESD_CHAR_DEVICE
+    if (commit_log.enabled) {
+        commit_start();
     }
+#endif
 
-    // Join remaining threads
+    housekeeper_start();
 
-    struct thread_entry *curr = NULL;
-    SLIST_FOREACH(curr, &threads, entries) {
-        if (!curr->joined) {
-            if (pthread_join(curr->thread, NULL) < 0) {
-                perror("pthread_join");
-                exit(EXIT_FAILURE);
-            }
-            curr->joined = true;
-            free(curr->params);
-        }
+    if (metrics.enabled) {
+        metrics_start();
+    }
+
+    if (event_loops > 0) {
+        run_event_loops(event_loops);
+    } else if (workers > 0) {
+        run_worker_pool(workers, queue_depth, reject);
+    } else {
+        run_connection_threads();
     }
 
-    // Free the thread list
+    housekeeper_stop();
 
-    while (!SLIST_EMPTY(&threads)) {
-        struct thread_entry *t = SLIST_FIRST(&threads);
-        SLIST_REMOVE_HEAD(&threads, entries);
-        free(t);
+    if (metrics.enabled) {
+        metrics_stop();
     }
 
-    SLIST_INIT(&threads);
+#ifndef USE_AESD_CHAR_DEVICE
+    if (commit_log.enabled) {
+        commit_stop();
+    }
+#endif
 
 #ifndef USE_AESD_CHAR_DEVICE
-    remove(filename);
+    history_close();
 #endif
 
-    shutdown(server_fd, SHUT_RDWR);
+    // Sockets handed over must be left listening for the new server
+
+    if (handoff.next_fd < 0) {
+        for (int i = 0; i < server_count; i++) {
+            shutdown(server_fds[i], SHUT_RDWR);
+        }
+    }
+    free(server_fds);
+
+    if (local_fd >= 0) {
+        close(local_fd);
+        if (handoff.next_fd < 0) {
+            unlink(local_path);
+        }
+    }
+
+    if (handoff.server_fd >= 0) {
+        close(handoff.server_fd);
+        if (handoff.next_fd < 0) {
+            unlink(handoff.path);
+        }
+    }
+
+    if (metrics.enabled) {
+        metrics_close();
+    }
+
     closelog();
 
     return EXIT_SUCCESS;
@@ -0,0 +1,57 @@
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+
+#define RECV_BUFFER_SIZE 1024
+#define REPLAY_BUFFER_SIZE 16384
+#define OUTPUT_STALL_TIMEOUT 30
+
+enum replay_source {
+    REPLAY_FILE,
+    REPLAY_MEMORY,
+    REPLAY_SENDFILE,
+    REPLAY_MMAP,
+};
+
+extern atomic_bool accepting;
+extern atomic_bool serving;
+extern int *server_fds;
+extern int server_count;
+extern char *local_path;
+extern int local_fd;
+extern int shutdown_fd;
+extern int close_fd;
+extern int drained_fd;
+extern atomic_int event_loops_running;
+
+extern char *filename;
+extern enum replay_source replay_source;
+extern bool pipelining;
+extern size_t output_low;
+extern size_t output_high;
+extern size_t output_hard;
+extern size_t line_cap;
+#ifdef USE_AESD_CHAR_DEVICE
+extern size_t packet_max;
+#endif
+
+int write_line(int fd, const char *line, size_t len);
+void mutex_lock(pthread_mutex_t *lock);
+void eventfd_post(int fd);
+void stop_accepting(void);
+void pin_thread(int index);
+void block_signals(sigset_t *oldmask);
+int listener_count(void);
+int listener_fd(int index);
+void listeners_set_nonblocking(void);
+void wait_for_shutdown(void);
+void wait_for_drain(bool (*drained)(void *arg), void *arg);
+void unix_address(struct sockaddr_un *address, const char *path);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,1029 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#include "aesdsocket.h"
+#include "connection.h"
+#include "history.h"
+#include "event_loop.h"
+#include "metrics.h"
+
+#define SPILL_TEMPLATE "/var/tmp/aesdsocket-spill-XXXXXX"
+#define SENDFILE_MAX_COUNT (1024 * 1024 * 1024)
+
+/**
+ * Describe a client for the log by its address, or by its process when it is
+ * connected through the Unix socket, which gives it no address.
+ */
+void format_peer(int connection_fd, struct sockaddr_storage *address, char *buf, size_t len) {
+
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+
+    if (address->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in*)address)->sin_addr, buf, len);
+    } else if (getsockopt(connection_fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0) {
+        snprintf(buf, len, "pid %d", (int)cred.pid);
+    } else {
+        snprintf(buf, len, "local");
+    }
+}
+
+struct connection *connection_create(int connection_fd, struct sockaddr_storage *address) {
+
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    if (!conn) {
+        perror("calloc");
+        return NULL;
+    }
+
+    conn->connection_fd = connection_fd;
+    conn->notify_fd = -1;
+    conn->spill_fd = -1;
+    conn->accepted_at = metrics_now();
+    format_peer(connection_fd, address, conn->client_address, sizeof(conn->client_address));
+
+    // A blocking send that makes no progress this long means the client stopped reading
+
+    struct timeval timeout = {
+        .tv_sec = OUTPUT_STALL_TIMEOUT,
+    };
+
+    if (setsockopt(connection_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror("setsockopt");
+    }
+
+    conn->buffer_size = RECV_BUFFER_SIZE;
+    if (!(conn->buffer = malloc(conn->buffer_size))) {
+        perror("malloc");
+        goto error;
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    if ((conn->file_fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        perror("open");
+        goto error;
+    }
+#else
+    conn->file_fd = -1;
+#endif
+
+    syslog(LOG_DEBUG, "Accepted connection from %s", conn->client_address);
+
+    metrics_count(METRIC_ACCEPTED, 1);
+
+    return conn;
+
+error:
+
+    free(conn->buffer);
+    free(conn);
+    return NULL;
+}
+
+void connection_destroy(struct connection *conn) {
+
+    free(conn->buffer);
+    free(conn->replay);
+    if (conn->spill_fd >= 0) {
+        close(conn->spill_fd);
+    }
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+    }
+    close(conn->connection_fd);
+
+    syslog(LOG_DEBUG, "Closed connection from %s", conn->client_address);
+
+    metrics_count(METRIC_CLOSED, 1);
+
+    free(conn);
+}
+
+/**
+ * Move the aesdchar file position to replay_pos.  The file build reads segments
+ * at their offsets instead.
+ */
+static void connection_replay_seek(struct connection *conn) {
+
+#ifdef USE_AESD_CHAR_DEVICE
+    lseek(conn->file_fd, conn->replay_pos, SEEK_SET);
+#else
+    (void)conn;
+#endif
+}
+
+/**
+ * Bytes of the reply being replayed that can be read at once, at most max.  In the
+ * file build this stops at the end of the segment holding replay_pos, which is
+ * opened for reading, and replay_pos first moves past history dropped since
+ * the reply was queued.
+ * @return the count, or -1 on error
+ */
+ssize_t connection_replay_span(struct connection *conn, size_t max) {
+
+#ifndef USE_AESD_CHAR_DEVICE
+    while (true) {
+
+        size_t start = atomic_load_explicit(&segment_log.start, memory_order_acquire);
+
+        if (conn->replay_pos < start) {
+            conn->replay_pos = start < conn->replay_end ? start : conn->replay_end;
+        }
+
+        if (conn->replay_pos == conn->replay_end) {
+            return 0;
+        }
+
+        if (segment_open_read(&conn->file_fd, &conn->file_segment, conn->replay_pos) == 0) {
+            break;
+        }
+
+        // A missing segment must have been dropped, which moved the start past it
+
+        if (errno != ENOENT || conn->replay_pos >= atomic_load(&segment_log.start)) {
+            perror("open");
+            return -1;
+        }
+    }
+
+    if (max > segment_room(conn->replay_pos)) {
+        max = segment_room(conn->replay_pos);
+    }
+#endif
+
+    size_t count = conn->replay_end - conn->replay_pos;
+    return count < max ? count : max;
+}
+
+/**
+ * Queue the replay of the history from offset start.  In the file build it stops at
+ * the published length, which becomes the mark an incremental replay resumes
+ * from, and is merged with the previous reply when they are contiguous.  The
+ * aesdchar driver is always replayed from its beginning to its end.  The caller
+ * must have checked the pending ring is not full.
+ */
+static void connection_replay_start(struct connection *conn, size_t start) {
+
+#ifdef USE_AESD_CHAR_DEVICE
+    size_t end = SIZE_MAX;
+    start = 0;
+#else
+    size_t end = atomic_load_explicit(&append_log.published, memory_order_acquire);
+    size_t first = atomic_load_explicit(&segment_log.start, memory_order_acquire);
+    if (start < first) {
+        start = first;
+    }
+    if (start > end) {
+        start = end;
+    }
+    conn->replay_mark = end;
+#endif
+
+    if (!conn->replaying) {
+        conn->replay_pos = start;
+        conn->replay_end = end;
+        conn->replaying = true;
+        connection_replay_seek(conn);
+        return;
+    }
+
+    struct replay_range *last = conn->pending_count == 0 ? NULL :
+            &conn->pending[(conn->pending_head + conn->pending_count - 1) % OUTPUT_QUEUE_RANGES];
+
+    if (!last && start == conn->replay_end) {
+        conn->replay_end = end;
+    } else if (last && start == last->end) {
+        conn->pending_bytes += end - last->end;
+        last->end = end;
+    } else {
+        last = &conn->pending[(conn->pending_head + conn->pending_count) % OUTPUT_QUEUE_RANGES];
+        last->start = start;
+        last->end = end;
+        conn->pending_count++;
+        conn->pending_bytes += end - start;
+    }
+}
+
+/**
+ * Move on to the next queued reply once the current one has been sent.
+ */
+void connection_replay_next(struct connection *conn) {
+
+    if (conn->pending_count == 0) {
+        conn->replaying = false;
+        return;
+    }
+
+    struct replay_range *next = &conn->pending[conn->pending_head];
+
+    conn->replay_pos = next->start;
+    conn->replay_end = next->end;
+    conn->pending_head = (conn->pending_head + 1) % OUTPUT_QUEUE_RANGES;
+    conn->pending_count--;
+    conn->pending_bytes -= next->end - next->start;
+
+    connection_replay_seek(conn);
+}
+
+/**
+ * Bytes of history still to be replayed to the client.
+ */
+size_t connection_output_queued(struct connection *conn) {
+
+#ifdef USE_AESD_CHAR_DEVICE
+    (void)conn;
+    return 0;
+#else
+    return conn->replaying ? conn->replay_end - conn->replay_pos + conn->pending_bytes : 0;
+#endif
+}
+
+/**
+ * Whether the connection should stop processing packets until more of its output
+ * has been sent.  Reading stops once output_high bytes are queued and resumes
+ * once they drop to output_low.  The aesdchar driver replays from the file
+ * position, which a later packet would move, so there it is one reply at a time.
+ */
+bool connection_output_full(struct connection *conn) {
+
+#ifdef USE_AESD_CHAR_DEVICE
+    return conn->replaying;
+#else
+    size_t queued = connection_output_queued(conn);
+
+    if (queued >= output_high) {
+        conn->paused = true;
+    } else if (queued <= output_low) {
+        conn->paused = false;
+    }
+
+    return conn->paused || conn->pending_count == OUTPUT_QUEUE_RANGES;
+#endif
+}
+
+void connection_sent(struct connection *conn, size_t len) {
+
+    conn->reply_bytes += len;
+    metrics_count(METRIC_BYTES_OUT, len);
+}
+
+/**
+ * Every reply queued so far has been sent: record how long the oldest packet they
+ * answer waited for it, and how much was replayed.  Called whenever the output
+ * is flushed, so does nothing until a packet has been received, nor while it is
+ * being appended.
+ */
+void connection_replied(struct connection *conn) {
+
+#ifndef USE_AESD_CHAR_DEVICE
+    if (conn->commit_seq || conn->publish_end) {
+        return;
+    }
+#endif
+
+#ifdef USE_IO_URING
+    if (conn->appending) {
+        return;
+    }
+#endif
+
+    if (conn->line_received) {
+        metrics_observe(METRIC_REPLY, metrics_now() - conn->line_received);
+        metrics_observe(METRIC_REPLAY_SIZE, conn->reply_bytes);
+        conn->line_received = 0;
+        conn->reply_bytes = 0;
+    }
+}
+
+/**
+ * A send would block: wait for the socket in an event loop, otherwise the send
+ * timeout expired without the client reading anything.
+ */
+static enum connection_status connection_would_block(struct connection *conn) {
+
+    if (conn->nonblocking) {
+        return CONNECTION_AGAIN;
+    }
+
+    syslog(LOG_DEBUG, "Disconnecting %s, not reading its replies", conn->client_address);
+    return CONNECTION_CLOSE;
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+
+/**
+ * Handle the replay commands, which are not appended to the history:
+ *   AESDSOCKET_REPLAYFROM:<offset>  replay from a byte offset
+ *   AESDSOCKET_REPLAYLINE:<line>    replay from a line, counting from 0
+ *   AESDSOCKET_REPLAYNEW            replay what was appended since the last replay
+ *   AESDSOCKET_INCREMENTAL:<0|1>    when 1, packets are answered with only what
+ *                                   was appended since the last replay, no reply
+ * @return 1 if line was a command, 0 otherwise
+ */
+static int connection_process_command(struct connection *conn, char *line, size_t len) {
+
+    char command[64];
+    size_t value;
+
+    snprintf(command, sizeof(command), "%.*s", (int)(len - 1), line);
+
+    if (sscanf(command, "AESDSOCKET_REPLAYFROM:%zu", &value) == 1) {
+        connection_replay_start(conn, value);
+    } else if (sscanf(command, "AESDSOCKET_REPLAYLINE:%zu", &value) == 1) {
+        connection_replay_start(conn, line_index_offset(value));
+    } else if (strcmp(command, "AESDSOCKET_REPLAYNEW") == 0) {
+        connection_replay_start(conn, conn->replay_mark);
+    } else if (sscanf(command, "AESDSOCKET_INCREMENTAL:%zu", &value) == 1) {
+        conn->incremental = value != 0;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+#endif
+
+static bool connection_is_command(const char *line) {
+
+#ifdef USE_AESD_CHAR_DEVICE
+    return strncmp(line, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0;
+#else
+    return strncmp(line, "AESDSOCKET_", strlen("AESDSOCKET_")) == 0;
+#endif
+}
+
+/**
+ * Length of the run of complete packets starting with the one of length len at
+ * line, stopping before the next command so commands keep their own reply.
+ */
+static size_t connection_pipeline_span(struct connection *conn, char *line, size_t len) {
+
+    char *end = &conn->buffer[conn->buffer_len];
+    char *next = line + len;
+    char *line_end;
+
+    while (next < end && (line_end = memchr(next, '\n', end - next)) && !connection_is_command(next)) {
+        next = line_end + 1;
+    }
+
+    return next - line;
+}
+
+/**
+ * Handle newline terminated packets (len includes the last newline) and arm the
+ * replay of the data file back to the client, in the file build once they are
+ * published or committed.  Only pipelining passes more than one packet, never
+ * with a command among them.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int connection_process_line(struct connection *conn, char *line, size_t len) {
+
+#ifdef USE_AESD_CHAR_DEVICE
+
+    if (connection_is_command(line)) {
+
+        struct aesd_seekto seekto;
+        unsigned int write_cmd, write_cmd_offset;
+        char command[64];
+
+        snprintf(command, sizeof(command), "%.*s", (int)(len - 1), line);
+        sscanf(command, "AESDCHAR_IOCSEEKTO:%u,%u", &write_cmd, &write_cmd_offset);
+
+        seekto.write_cmd = write_cmd;
+        seekto.write_cmd_offset = write_cmd_offset;
+
+        if (ioctl(conn->file_fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
+            perror("ioctl");
+            return -1;
+        }
+
+        // Replay from the position the driver seeked to, no other reply is queued
+
+        conn->replay_pos = 0;
+        conn->replay_end = SIZE_MAX;
+        conn->replaying = true;
+
+        return 0;
+    }
+
+    // The driver stores everything up to the end of a write as one command
+
+    for (char *next = line; next < line + len; ) {
+
+        size_t n = (char*)memchr(next, '\n', line + len - next) - next + 1;
+
+        if (write_line(conn->file_fd, next, n) < 0) {
+            return -1;
+        }
+
+        next += n;
+    }
+
+    connection_replay_start(conn, conn->incremental ? conn->replay_mark : 0);
+
+    return 0;
+#else
+
+    if (connection_is_command(line) && connection_process_command(conn, line, len)) {
+        return 0;
+    }
+
+    if (commit_log.enabled) {
+        return commit_submit(conn, line, len);
+    }
+
+#ifdef USE_IO_URING
+    if (conn->loop) {
+        return uring_append(conn, line, len);
+    }
+#endif
+
+    struct iovec iov = {
+        .iov_base = line,
+        .iov_len = len,
+    };
+
+    // The replay is armed by connection_publish_wait
+
+    return history_append(&iov, 1, &conn->publish_end);
+#endif
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+
+/**
+ * Wait for the line submitted by the connection to be committed and arm its replay.
+ * Connections owned by an event loop do not block but return CONNECTION_AGAIN,
+ * the loop runs them again when the commit thread writes to their notify_fd.
+ */
+enum connection_status connection_commit_wait(struct connection *conn) {
+
+    mutex_lock(&commit_log.lock);
+
+    while (commit_log.committed < conn->commit_seq) {
+        if (conn->notify_fd >= 0) {
+            pthread_mutex_unlock(&commit_log.lock);
+            return CONNECTION_AGAIN;
+        }
+        pthread_cond_wait(&commit_log.committed_cond, &commit_log.lock);
+    }
+
+    bool failed = commit_log.failed;
+
+    pthread_mutex_unlock(&commit_log.lock);
+
+    conn->commit_seq = 0;
+
+    if (failed) {
+        return CONNECTION_CLOSE;
+    }
+
+    connection_replay_start(conn, conn->incremental ? conn->replay_mark : 0);
+
+    return CONNECTION_DONE;
+}
+
+/**
+ * Wait for the last append of the connection to be published and arm its replay.
+ * Like connection_commit_wait, a connection owned by an event loop returns
+ * CONNECTION_AGAIN instead and is run again once its notify_fd is written.
+ */
+enum connection_status connection_publish_wait(struct connection *conn) {
+
+    int rc = history_published(conn->publish_end, conn->notify_fd);
+
+    if (rc == 0) {
+        return CONNECTION_AGAIN;
+    }
+
+    conn->publish_end = 0;
+
+    if (rc < 0) {
+        return CONNECTION_CLOSE;
+    }
+
+    connection_replay_start(conn, conn->incremental ? conn->replay_mark : 0);
+
+    return CONNECTION_DONE;
+}
+
+/**
+ * Gather the next MEMLOG_MAX_IOV chunks of the memlog range being replayed, or
+ * windows of the history mapped for REPLAY_MMAP.  Every published chunk of the
+ * memlog is allocated, as history_reserve refuses appends past its end and a
+ * range whose copy failed is never published.
+ * @return the number of iovecs filled, or -1 if the history could not be mapped
+ */
+int connection_memlog_iov(struct connection *conn, struct iovec *iov) {
+
+    size_t pos = conn->replay_pos;
+    int iovcnt = 0;
+
+    while (pos < conn->replay_end && iovcnt < MEMLOG_MAX_IOV) {
+
+        size_t n;
+
+        if (replay_source == REPLAY_MMAP) {
+            if (!(iov[iovcnt].iov_base = (void*)history_map(pos, &n))) {
+                return -1;
+            }
+        } else {
+            n = MEMLOG_CHUNK_SIZE - pos % MEMLOG_CHUNK_SIZE;
+            iov[iovcnt].iov_base = &memlog.chunks[pos / MEMLOG_CHUNK_SIZE][pos % MEMLOG_CHUNK_SIZE];
+        }
+
+        if (n > conn->replay_end - pos) {
+            n = conn->replay_end - pos;
+        }
+
+        iov[iovcnt].iov_len = n;
+        iovcnt++;
+        pos += n;
+    }
+
+    return iovcnt;
+}
+
+/**
+ * Send the memlog range being replayed, gathering up to MEMLOG_MAX_IOV chunks per
+ * sendmsg, or the mapped history likewise.
+ */
+static enum connection_status connection_flush_memlog(struct connection *conn) {
+
+    while (conn->replay_pos < conn->replay_end) {
+
+        struct iovec iov[MEMLOG_MAX_IOV];
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+
+        int iovcnt = connection_memlog_iov(conn, iov);
+        if (iovcnt < 0) {
+            return CONNECTION_CLOSE;
+        }
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t nsend = sendmsg(conn->connection_fd, &msg, MSG_NOSIGNAL);
+        if (nsend == -1) {
+            if (errno == EINTR) {
+                if (!atomic_load(&serving)) {
+                    return CONNECTION_CLOSE;
+                }
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return connection_would_block(conn);
+            }
+            perror("sendmsg");
+            return CONNECTION_CLOSE;
+        }
+
+        conn->replay_pos += nsend;
+        connection_sent(conn, nsend);
+    }
+
+    connection_replay_next(conn);
+
+    return CONNECTION_DONE;
+}
+#endif
+
+/**
+ * Send the history from replay_pos up to replay_end with sendfile, one segment at a
+ * time, so the replay goes from the page cache to the socket without passing
+ * through user space.  The aesdchar driver cannot be spliced from, in which case the connection
+ * falls back to the buffered copy in connection_flush.
+ */
+static enum connection_status connection_flush_sendfile(struct connection *conn) {
+
+    while (true) {
+
+        ssize_t count = connection_replay_span(conn, SENDFILE_MAX_COUNT);
+        if (count < 0) {
+            return CONNECTION_CLOSE;
+        }
+
+        if (count == 0) {
+            connection_replay_next(conn);
+            return CONNECTION_DONE;
+        }
+
+#ifdef USE_AESD_CHAR_DEVICE
+        ssize_t nsend = sendfile(conn->connection_fd, conn->file_fd, NULL, count);
+#else
+        off_t offset = segment_offset(conn->replay_pos);
+        ssize_t nsend = sendfile(conn->connection_fd, conn->file_fd, &offset, count);
+#endif
+        if (nsend == -1) {
+            if (errno == EINTR) {
+                if (!atomic_load(&serving)) {
+                    return CONNECTION_CLOSE;
+                }
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return connection_would_block(conn);
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                conn->sendfile_unsupported = true;
+                return CONNECTION_DONE;
+            }
+            perror("sendfile");
+            return CONNECTION_CLOSE;
+        }
+
+        if (nsend == 0) {
+            connection_replay_next(conn);
+            return CONNECTION_DONE;
+        }
+
+        conn->replay_pos += nsend;
+        connection_sent(conn, nsend);
+    }
+}
+
+/**
+ * Send any pending replay data, refilling from the data file until it is exhausted.
+ * @return CONNECTION_DONE when nothing is left to send, CONNECTION_AGAIN if the
+ * socket would block, CONNECTION_CLOSE on error
+ */
+static enum connection_status connection_flush(struct connection *conn) {
+
+    while (true) {
+
+        if (conn->replay_sent < conn->replay_len) {
+
+            ssize_t nsend = send(conn->connection_fd, &conn->replay[conn->replay_sent],
+                    conn->replay_len - conn->replay_sent, MSG_NOSIGNAL);
+            if (nsend == -1) {
+                if (errno == EINTR) {
+                    if (!atomic_load(&serving)) {
+                        return CONNECTION_CLOSE;
+                    }
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return connection_would_block(conn);
+                }
+                perror("send");
+                return CONNECTION_CLOSE;
+            }
+
+            conn->replay_sent += nsend;
+            connection_sent(conn, nsend);
+            continue;
+        }
+
+        if (!conn->replaying) {
+            return CONNECTION_DONE;
+        }
+
+#ifndef USE_AESD_CHAR_DEVICE
+        if (replay_source == REPLAY_MEMORY || replay_source == REPLAY_MMAP) {
+            enum connection_status status = connection_flush_memlog(conn);
+            if (status != CONNECTION_DONE) {
+                return status;
+            }
+            continue;
+        }
+#endif
+
+        // Continues with the next reply, or the copy below if sendfile is unsupported
+
+        if (replay_source == REPLAY_SENDFILE && !conn->sendfile_unsupported) {
+            enum connection_status status = connection_flush_sendfile(conn);
+            if (status != CONNECTION_DONE) {
+                return status;
+            }
+            continue;
+        }
+
+        // Buffers are only needed for a copied replay, so allocate on first use
+
+        if (!conn->replay && !(conn->replay = malloc(REPLAY_BUFFER_SIZE))) {
+            perror("malloc");
+            return CONNECTION_CLOSE;
+        }
+
+        // Read the next block of the file to send back to client
+
+        ssize_t count = connection_replay_span(conn, REPLAY_BUFFER_SIZE);
+        if (count < 0) {
+            return CONNECTION_CLOSE;
+        }
+
+#ifdef USE_AESD_CHAR_DEVICE
+        ssize_t nread = count ? read(conn->file_fd, conn->replay, count) : 0;
+#else
+        ssize_t nread = count ? pread(conn->file_fd, conn->replay, count, segment_offset(conn->replay_pos)) : 0;
+#endif
+        if (nread == -1) {
+            if (errno == EINTR) {
+                if (!atomic_load(&serving)) {
+                    return CONNECTION_CLOSE;
+                }
+                continue;
+            }
+            perror("read");
+            return CONNECTION_CLOSE;
+        }
+
+        if (nread == 0) {
+            connection_replay_next(conn);
+        }
+
+        conn->replay_pos += nread;
+        conn->replay_len = nread;
+        conn->replay_sent = 0;
+    }
+}
+
+/**
+ * Move data to the end of the spill file, creating it for the first spilled bytes
+ * of a packet.
+ * @return 0 on success, -1 on error
+ */
+static int connection_spill(struct connection *conn, const char *data, size_t len) {
+
+    if (conn->spill_fd < 0) {
+
+        char path[] = SPILL_TEMPLATE;
+
+        if ((conn->spill_fd = mkostemp(path, O_CLOEXEC)) < 0) {
+            perror("mkostemp");
+            return -1;
+        }
+
+        unlink(path);
+        syslog(LOG_DEBUG, "Spilling packet from %s to disk", conn->client_address);
+    }
+
+    if (write_line(conn->spill_fd, data, len) < 0) {
+        return -1;
+    }
+
+    conn->spill_len += len;
+
+    return 0;
+}
+
+/**
+ * Complete a spilled packet with its tail, which ends with the newline, append it
+ * to the history and arm the replay, once published in the file build.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int connection_process_spill(struct connection *conn, const char *tail, size_t len) {
+
+    int rc = connection_spill(conn, tail, len);
+
+#ifdef USE_AESD_CHAR_DEVICE
+
+    // A command arriving in a single write skips the driver's staging, and drivers
+    // without staging per open file only keep it whole that way
+
+    if (rc == 0) {
+
+        char *packet = mmap(NULL, conn->spill_len, PROT_READ, MAP_PRIVATE, conn->spill_fd, 0);
+        if (packet == MAP_FAILED) {
+            perror("mmap");
+            rc = -1;
+        } else {
+            rc = write_line(conn->file_fd, packet, conn->spill_len);
+            munmap(packet, conn->spill_len);
+        }
+    }
+#else
+#ifdef USE_IO_URING
+    if (rc == 0 && conn->loop) {
+        return uring_append(conn, NULL, conn->spill_len);
+    }
+#endif
+    if (rc == 0) {
+        rc = history_append_file(conn->spill_fd, conn->spill_len, &conn->publish_end);
+    }
+#endif
+
+    close(conn->spill_fd);
+    conn->spill_fd = -1;
+    conn->spill_len = 0;
+
+    if (rc < 0) {
+        return -1;
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    connection_replay_start(conn, conn->incremental ? conn->replay_mark : 0);
+#endif
+
+    return 0;
+}
+
+/**
+ * Whether the packet being received, len bytes of it in buffer after what was
+ * spilled, is too long for the aesdchar driver to store, which refuses it
+ * rather than losing it once it has been received in full.
+ */
+static bool connection_packet_refused(struct connection *conn, size_t len) {
+
+#ifdef USE_AESD_CHAR_DEVICE
+    if (conn->spill_len + len > packet_max) {
+        syslog(LOG_INFO, "Disconnecting %s, packet longer than the %zu bytes aesdchar stores",
+                conn->client_address, packet_max);
+        return true;
+    }
+#else
+    (void)conn;
+    (void)len;
+#endif
+
+    return false;
+}
+
+/**
+ * Process the next packet in buffer if it is complete.  Otherwise make room at the
+ * end of buffer for receiving more of it, growing buffer up to line_cap and
+ * spilling the packet once it fills that.
+ * @return 1 if a packet was processed, 0 if more must be received first, -1 if
+ * the connection should be closed
+ */
+int connection_next_packet(struct connection *conn) {
+
+    char *line_start = &conn->buffer[conn->buffer_start];
+    char *line_end = (char*)memchr((void*)&line_start[conn->buffer_scanned], '\n',
+            conn->buffer_len - conn->buffer_start - conn->buffer_scanned);
+
+    if (line_end) {
+
+        size_t line_len = line_end - line_start + 1;
+        int rc;
+
+        if (connection_packet_refused(conn, line_len)) {
+            return -1;
+        }
+
+        if (!conn->line_received) {
+            conn->line_received = metrics_now();
+        }
+
+        if (conn->spill_fd >= 0) {
+            rc = connection_process_spill(conn, line_start, line_len);
+        } else {
+            if (pipelining && !connection_is_command(line_start)) {
+                line_len = connection_pipeline_span(conn, line_start, line_len);
+            }
+            rc = connection_process_line(conn, line_start, line_len);
+        }
+
+        if (rc < 0) {
+            return -1;
+        }
+        conn->buffer_start += line_len;
+        conn->buffer_scanned = 0;
+        return 1;
+    }
+
+    conn->buffer_scanned = conn->buffer_len - conn->buffer_start;
+
+    // The newline still to come would take the packet over the driver's limit
+
+    if (connection_packet_refused(conn, conn->buffer_scanned + 1)) {
+        return -1;
+    }
+
+    // Shift unprocessed data to start of buffer
+
+    if (conn->buffer_start > 0) {
+        conn->buffer_len -= conn->buffer_start;
+        memmove(conn->buffer, line_start, conn->buffer_len);
+        conn->buffer_start = 0;
+    }
+
+    // A packet that filled the buffer at line_cap continues in its spill file
+
+    if (conn->spill_fd >= 0 || (conn->buffer_len == conn->buffer_size && conn->buffer_size >= line_cap)) {
+
+        if (connection_spill(conn, conn->buffer, conn->buffer_len) < 0) {
+            return -1;
+        }
+
+        conn->buffer_len = 0;
+        conn->buffer_scanned = 0;
+
+    } else if (conn->buffer_len == conn->buffer_size) {
+
+        // Increase buffer size and reallocate if buffer is full
+
+        size_t buffer_size = conn->buffer_size * 2 < line_cap ? conn->buffer_size * 2 : line_cap;
+
+        char *new_buffer = realloc(conn->buffer, buffer_size);
+        if (!new_buffer) {
+            perror("realloc");
+            return -1;
+        }
+
+        conn->buffer = new_buffer;
+        conn->buffer_size = buffer_size;
+    }
+
+    return 0;
+}
+
+/**
+ * Account for nread bytes just received at the end of buffer.
+ */
+void connection_received(struct connection *conn, size_t nread) {
+
+    if (conn->accepted_at) {
+        metrics_observe(METRIC_FIRST_BYTE, metrics_now() - conn->accepted_at);
+        conn->accepted_at = 0;
+    }
+
+    metrics_count(METRIC_BYTES_IN, nread);
+    conn->buffer_len += nread;
+}
+
+/**
+ * Drive the connection until it would block or should be closed.  With a
+ * non-blocking socket, packets keep being processed while earlier replies are
+ * still being sent, until connection_output_full.  Replies are queued in order,
+ * so the client is never answered out of order.
+ * @return CONNECTION_AGAIN or CONNECTION_CLOSE
+ */
+enum connection_status connection_run(struct connection *conn) {
+
+    while (true) {
+
+        enum connection_status status = connection_flush(conn);
+        if (status == CONNECTION_CLOSE) {
+            return status;
+        }
+        if (status == CONNECTION_DONE) {
+            connection_replied(conn);
+        }
+
+#ifndef USE_AESD_CHAR_DEVICE
+        if (conn->commit_seq || conn->publish_end) {
+            status = conn->commit_seq ? connection_commit_wait(conn) : connection_publish_wait(conn);
+            if (status != CONNECTION_DONE) {
+                return status;
+            }
+            continue;
+        }
+#endif
+
+        if (connection_output_full(conn)) {
+            return CONNECTION_AGAIN;
+        }
+
+        int rc = connection_next_packet(conn);
+        if (rc < 0) {
+            return CONNECTION_CLOSE;
+        }
+        if (rc > 0) {
+            continue;
+        }
+
+        ssize_t nread = recv(conn->connection_fd, &conn->buffer[conn->buffer_len],
+                conn->buffer_size - conn->buffer_len, 0);
+        if (nread == 0) {
+            return CONNECTION_CLOSE;
+        }
+
+        if (nread == -1) {
+            if (errno == EINTR) {
+                if (!atomic_load(&serving)) {
+                    return CONNECTION_CLOSE;
+                }
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return CONNECTION_AGAIN;
+            }
+            perror("recv");
+            return CONNECTION_CLOSE;
+        }
+
+        connection_received(conn, nread);
+    }
+}
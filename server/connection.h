@@ -0,0 +1,122 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define MEMLOG_MAX_IOV 64
+#define OUTPUT_QUEUE_RANGES 64
+
+struct event_loop;
+
+enum connection_status {
+    CONNECTION_DONE,
+    CONNECTION_AGAIN,
+    CONNECTION_CLOSE,
+};
+
+struct replay_range {
+    size_t start;
+    size_t end;
+};
+
+/**
+ * Per-connection protocol state, shared by the threaded and event loop modes.
+ * Received bytes accumulate in buffer until a newline completes a packet, the
+ * first buffer_scanned of them past buffer_start are known not to hold one.
+ * Once buffer reaches line_cap, the packet continues in the unlinked spill file
+ * until its newline arrives.  The replay of the data file that follows is
+ * staged through replay so it can be resumed when the socket is non-blocking.
+ * The range being replayed is replay_pos to replay_end, replies to later
+ * packets wait in the pending ring as ranges of the history rather than copies
+ * of it.  In the file build, file_fd is the segment file_segment being replayed.
+ * For the metrics, accepted_at is cleared by the first byte received and
+ * line_received by the reply that answers the oldest packet still unanswered,
+ * reply_bytes counting what that reply sent.  In the file build, publish_end is
+ * the end of the connection's last append while it waits for it to be published
+ * before replaying.  A connection of an io_uring event loop counts its requests
+ * on the ring in inflight, and is only freed once they have all completed.
+ */
+struct connection {
+    int connection_fd;
+    int file_fd;
+    size_t file_segment;
+    char client_address[INET_ADDRSTRLEN];
+    char *buffer;
+    size_t buffer_size;
+    size_t buffer_start;
+    size_t buffer_len;
+    size_t buffer_scanned;
+    int spill_fd;
+    size_t spill_len;
+    char *replay;
+    size_t replay_len;
+    size_t replay_sent;
+    size_t replay_pos;
+    size_t replay_end;
+    size_t replay_mark;
+    struct replay_range pending[OUTPUT_QUEUE_RANGES];
+    size_t pending_head;
+    size_t pending_count;
+    size_t pending_bytes;
+    bool replaying;
+    bool paused;
+    bool incremental;
+    bool sendfile_unsupported;
+    bool nonblocking;
+    unsigned long commit_seq;
+    size_t publish_end;
+    int notify_fd;
+    bool committing;
+    bool stalled;
+    time_t stalled_since;
+    uint64_t accepted_at;
+    uint64_t line_received;
+    size_t reply_bytes;
+#ifdef USE_IO_URING
+    struct event_loop *loop;
+    unsigned int inflight;
+    bool receiving;
+    unsigned int sends;
+    bool appending;
+    bool closing;
+    char *append_data;
+    size_t append_len;
+    size_t append_offset;
+    size_t append_written;
+    unsigned int append_writes;
+    bool append_failed;
+    struct msghdr msg;
+    struct iovec iov[MEMLOG_MAX_IOV];
+    TAILQ_ENTRY(connection) append_entries;
+#endif
+    LIST_ENTRY(connection) entries;
+    TAILQ_ENTRY(connection) commit_entries;
+    LIST_ENTRY(connection) stalled_entries;
+};
+
+void format_peer(int connection_fd, struct sockaddr_storage *address, char *buf, size_t len);
+struct connection *connection_create(int connection_fd, struct sockaddr_storage *address);
+void connection_destroy(struct connection *conn);
+ssize_t connection_replay_span(struct connection *conn, size_t max);
+void connection_replay_next(struct connection *conn);
+size_t connection_output_queued(struct connection *conn);
+bool connection_output_full(struct connection *conn);
+void connection_sent(struct connection *conn, size_t len);
+void connection_replied(struct connection *conn);
+
+#ifndef USE_AESD_CHAR_DEVICE
+enum connection_status connection_commit_wait(struct connection *conn);
+enum connection_status connection_publish_wait(struct connection *conn);
+int connection_memlog_iov(struct connection *conn, struct iovec *iov);
+#endif
+int connection_next_packet(struct connection *conn);
+void connection_received(struct connection *conn, size_t nread);
+enum connection_status connection_run(struct connection *conn);
+
+#endif /* CONNECTION_H */
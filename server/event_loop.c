@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/queue.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "aesdsocket.h"
+#include "event_loop.h"
+#include "connection.h"
+#include "history.h"
+
+void event_loop_close(struct event_loop *loop, struct connection *conn) {
+
+    if (conn->committing) {
+        TAILQ_REMOVE(&loop->waiting, conn, commit_entries);
+    }
+
+    if (conn->stalled) {
+        LIST_REMOVE(conn, stalled_entries);
+    }
+
+    LIST_REMOVE(conn, entries);
+#ifdef USE_IO_URING
+    uring_release(conn);
+#else
+    connection_destroy(conn);
+#endif
+}
+
+/**
+ * Run a connection, keeping it on the waiting list while its last line is being
+ * committed or published and on the stalled list while its queued output is
+ * over output_hard.
+ */
+void event_loop_run(struct event_loop *loop, struct connection *conn) {
+
+    if (conn->committing) {
+        TAILQ_REMOVE(&loop->waiting, conn, commit_entries);
+        conn->committing = false;
+    }
+
+#ifdef USE_IO_URING
+    if (uring_run(conn) == CONNECTION_CLOSE) {
+#else
+    if (connection_run(conn) == CONNECTION_CLOSE) {
+#endif
+        event_loop_close(loop, conn);
+        return;
+    }
+
+    if (conn->commit_seq || conn->publish_end) {
+        TAILQ_INSERT_TAIL(&loop->waiting, conn, commit_entries);
+        conn->committing = true;
+    }
+
+    bool stalled = connection_output_queued(conn) > output_hard;
+
+    if (stalled && !conn->stalled) {
+        LIST_INSERT_HEAD(&loop->stalled, conn, stalled_entries);
+        conn->stalled_since = time(NULL);
+    } else if (!stalled && conn->stalled) {
+        LIST_REMOVE(conn, stalled_entries);
+    }
+
+    conn->stalled = stalled;
+}
+
+/**
+ * Disconnect clients whose queued output has been over output_hard for longer than
+ * OUTPUT_STALL_TIMEOUT, so slow consumers cannot pin history indefinitely.
+ */
+void event_loop_expire(struct event_loop *loop) {
+
+    time_t now = time(NULL);
+    struct connection *next;
+
+    for (struct connection *conn = LIST_FIRST(&loop->stalled); conn; conn = next) {
+
+        next = LIST_NEXT(conn, stalled_entries);
+
+        if (now - conn->stalled_since >= OUTPUT_STALL_TIMEOUT) {
+            syslog(LOG_DEBUG, "Disconnecting %s, not reading its replies", conn->client_address);
+            event_loop_close(loop, conn);
+        }
+    }
+}
+
+void event_loop_exit(void) {
+
+    if (atomic_fetch_sub(&event_loops_running, 1) == 1) {
+        eventfd_post(drained_fd);
+    }
+}
+
+static bool event_loops_drained(void *arg) {
+
+    return atomic_load(&event_loops_running) == 0;
+}
+
+/**
+ * Run every connection waiting for a commit or a publish, those whose line is not
+ * committed or published yet go back on the waiting list.
+ */
+void event_loop_commit(struct event_loop *loop) {
+
+    struct commit_list waiting = TAILQ_HEAD_INITIALIZER(waiting);
+    uint64_t count;
+
+    if (read(loop->commit_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read");
+    }
+
+    TAILQ_CONCAT(&waiting, &loop->waiting, commit_entries);
+
+    while (!TAILQ_EMPTY(&waiting)) {
+        struct connection *conn = TAILQ_FIRST(&waiting);
+        TAILQ_REMOVE(&waiting, conn, commit_entries);
+        conn->committing = false;
+        event_loop_run(loop, conn);
+    }
+}
+
+/**
+ * Serve all connections from nloops event loop threads, assigned round robin to the
+ * listening sockets.  Loops sharing a socket are woken one at a time for it, or
+ * race to accept with io_uring.  Returns once a termination signal has been
+ * received, or a new server has taken over and the loops are drained, and
+ * every loop has exited.
+ */
+void run_event_loops(int nloops) {
+
+    struct event_loop *loops = calloc(nloops, sizeof(struct event_loop));
+    sigset_t oldmask;
+
+    if (!loops) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // io_uring waits for the listening sockets itself, so they are left blocking for it
+
+#ifndef USE_IO_URING
+    listeners_set_nonblocking();
+#endif
+
+    // Signals are left to the main thread, the timestamp must not interrupt an append
+
+    block_signals(&oldmask);
+
+    atomic_store(&event_loops_running, nloops);
+
+    for (int i = 0; i < nloops; i++) {
+
+        loops[i].index = i;
+        loops[i].server_fd = server_fds[i % server_count];
+        loops[i].commit_fd = -1;
+        LIST_INIT(&loops[i].connections);
+        TAILQ_INIT(&loops[i].waiting);
+        LIST_INIT(&loops[i].stalled);
+
+#ifndef USE_AESD_CHAR_DEVICE
+        if ((loops[i].commit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            perror("eventfd");
+            exit(EXIT_FAILURE);
+        }
+#endif
+
+        event_loop_setup(&loops[i]);
+
+        if (pthread_create(&loops[i].thread, NULL, event_loop_thread, &loops[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    wait_for_shutdown();
+
+    wait_for_drain(event_loops_drained, NULL);
+
+    for (int i = 0; i < nloops; i++) {
+        if (pthread_join(loops[i].thread, NULL) != 0) {
+            perror("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+        event_loop_teardown(&loops[i]);
+    }
+
+    // The commit thread may still notify the loops until it is stopped
+
+#ifndef USE_AESD_CHAR_DEVICE
+    if (commit_log.enabled) {
+        commit_stop();
+    }
+#endif
+
+    for (int i = 0; i < nloops; i++) {
+        if (loops[i].commit_fd >= 0) {
+            close(loops[i].commit_fd);
+        }
+    }
+
+    free(loops);
+}
@@ -0,0 +1,90 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+#include <sys/queue.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "connection.h"
+
+#ifdef USE_IO_URING
+
+/**
+ * An io_uring, set up with the raw system calls rather than through liburing.  The
+ * loop thread is its only user, and nothing is submitted before it enters the
+ * ring, so entries are made visible to the kernel as soon as they are taken.
+ * Receives pick one of URING_BUFFERS buffers from the provided buffer ring,
+ * registered as group 0, which get them back once their data is copied out.
+ */
+struct uring {
+    int fd;
+    void *rings;
+    size_t rings_size;
+    _Atomic unsigned int *sq_head;
+    _Atomic unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned int *cq_head;
+    _Atomic unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buffer_ring;
+    char *buffers;
+    unsigned short buffer_tail;
+};
+#endif
+
+/**
+ * Connections waiting for their line to be committed or published are on waiting,
+ * and commit_fd is written to wake the loop for them.  With io_uring,
+ * connections whose appends are being written wait on appending in the order of
+ * their ranges, which are committed from its head, and pending counts the
+ * requests of all the loop's connections, closed or not.
+ */
+struct event_loop {
+    pthread_t thread;
+    int index;
+    int server_fd;
+    int commit_fd;
+    LIST_HEAD(connection_list, connection) connections;
+    TAILQ_HEAD(commit_list, connection) waiting;
+    struct connection_list stalled;
+#ifdef USE_IO_URING
+    struct uring ring;
+    struct commit_list appending;
+    unsigned long pending;
+    struct __kernel_timespec timeout;
+    bool timing;
+#else
+    int epoll_fd;
+#endif
+};
+
+/**
+ * Backend of the event loops, event_loop_epoll.c or event_loop_uring.c depending
+ * on USE_IO_URING.
+ */
+void event_loop_setup(struct event_loop *loop);
+void event_loop_teardown(struct event_loop *loop);
+void *event_loop_thread(void *arg);
+
+#ifdef USE_IO_URING
+void uring_release(struct connection *conn);
+enum connection_status uring_run(struct connection *conn);
+#ifndef USE_AESD_CHAR_DEVICE
+int uring_append(struct connection *conn, char *data, size_t len);
+#endif
+#endif
+
+void event_loop_close(struct event_loop *loop, struct connection *conn);
+void event_loop_run(struct event_loop *loop, struct connection *conn);
+void event_loop_expire(struct event_loop *loop);
+void event_loop_exit(void);
+void event_loop_commit(struct event_loop *loop);
+void run_event_loops(int nloops);
+
+#endif /* EVENT_LOOP_H */
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <sys/queue.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+#include "event_loop.h"
+#include "connection.h"
+
+#define MAX_EVENTS 64
+
+/**
+ * Accept new connections on server_fd, the loop's shard or the Unix socket.
+ */
+static void event_loop_accept(struct event_loop *loop, int server_fd) {
+
+    while (atomic_load(&accepting)) {
+
+        int accept_fd;
+        struct sockaddr_storage address;
+        socklen_t addrlen = sizeof(address);
+
+        if ((accept_fd = accept4(server_fd, (struct sockaddr*)&address, &addrlen,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        struct connection *conn = connection_create(accept_fd, &address);
+        if (!conn) {
+            close(accept_fd);
+            continue;
+        }
+
+        conn->notify_fd = loop->commit_fd;
+        conn->nonblocking = true;
+
+        // Edge triggered for both directions, connection_run is called on any change
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, accept_fd, &event) < 0) {
+            perror("epoll_ctl");
+            connection_destroy(conn);
+            continue;
+        }
+
+        LIST_INSERT_HEAD(&loop->connections, conn, entries);
+    }
+}
+
+/**
+ * Stop polling the listening sockets, left to a new server taking over, and
+ * shutdown_fd, which stays readable.
+ */
+static void event_loop_stop_accepting(struct event_loop *loop) {
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->server_fd, NULL) < 0 ||
+            (local_fd >= 0 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, local_fd, NULL) < 0) ||
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, shutdown_fd, NULL) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+/**
+ * Serve the loop's connections until accepting is cleared and they are closed,
+ * or until serving is cleared, closing those left.
+ */
+void *event_loop_thread(void *arg) {
+
+    struct event_loop *loop = (struct event_loop*)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    pin_thread(loop->index);
+
+    while (atomic_load(&serving) && (atomic_load(&accepting) || !LIST_EMPTY(&loop->connections))) {
+
+        bool committed = false;
+
+        // Wake up once a second while there are stalled connections to expire
+
+        int timeout = LIST_EMPTY(&loop->stalled) ? -1 : 1000;
+        int nevents = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nevents; i++) {
+
+            if (events[i].data.ptr == NULL) {
+                event_loop_accept(loop, loop->server_fd);
+            } else if (events[i].data.ptr == &local_fd) {
+                event_loop_accept(loop, local_fd);
+            } else if (events[i].data.ptr == &shutdown_fd) {
+                atomic_store(&accepting, false);
+                event_loop_stop_accepting(loop);
+            } else if (events[i].data.ptr == &close_fd) {
+                continue;
+            } else if (events[i].data.ptr == &loop->commit_fd) {
+                committed = true;
+            } else {
+                event_loop_run(loop, events[i].data.ptr);
+            }
+        }
+
+        // Waiting connections may be closed, so only run them once no event refers to them
+
+        if (committed) {
+            event_loop_commit(loop);
+        }
+
+        if (!LIST_EMPTY(&loop->stalled)) {
+            event_loop_expire(loop);
+        }
+    }
+
+    // Close connections still owned by this loop
+
+    while (!LIST_EMPTY(&loop->connections)) {
+        struct connection *conn = LIST_FIRST(&loop->connections);
+        LIST_REMOVE(conn, entries);
+        connection_destroy(conn);
+    }
+
+    event_loop_exit();
+
+    return loop;
+}
+
+/**
+ * Set up the epoll instance of a loop: its shard, the Unix socket and commit_fd
+ * edge triggered, shutdown_fd and close_fd level triggered.
+ */
+void event_loop_setup(struct event_loop *loop) {
+
+    struct epoll_event event;
+
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only one loop is woken per incoming connection
+
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->server_fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    // The Unix socket is not sharded, every loop takes its turn on it
+
+    if (local_fd >= 0) {
+        event.data.ptr = &local_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, local_fd, &event) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Level triggered so that every loop sees the shutdown
+
+    event.events = EPOLLIN;
+    event.data.ptr = &shutdown_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    event.data.ptr = &close_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, close_fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    if (loop->commit_fd >= 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &loop->commit_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->commit_fd, &event) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void event_loop_teardown(struct event_loop *loop) {
+
+    close(loop->epoll_fd);
+}
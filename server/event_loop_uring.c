@@ -0,0 +1,832 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+#include "event_loop.h"
+#include "connection.h"
+#include "history.h"
+#include "metrics.h"
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+#define URING_REPLAY_BLOCKS 8
+#define URING_OP_MASK 3
+
+/**
+ * Requests queued for a connection, kept in the low bits of their user_data.
+ * Requests of the loop itself carry the address of the descriptor they are on.
+ */
+enum uring_op {
+    URING_RECV,
+    URING_SEND,
+    URING_READ,
+    URING_WRITE,
+};
+
+/**
+ * Give buffer bid back to the kernel for another receive.
+ */
+static void uring_recycle(struct uring *ring, unsigned short bid) {
+
+    struct io_uring_buf *buf = &ring->buffer_ring->bufs[ring->buffer_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uintptr_t)&ring->buffers[(size_t)bid * URING_BUFFER_SIZE];
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+
+    ring->buffer_tail++;
+    atomic_store_explicit((_Atomic unsigned short*)&ring->buffer_ring->tail, ring->buffer_tail,
+            memory_order_release);
+}
+
+/**
+ * Set up the ring and register its receive buffers, which along with multishot
+ * accept needs Linux 5.19.
+ */
+static void uring_open(struct uring *ring) {
+
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+
+    // Completions are only reaped when the loop asks for them, so the kernel need
+    // not interrupt it to post them
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+
+    if (ring->fd < 0) {
+        perror("io_uring_setup");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "io_uring too old\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->buffer_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffer_ring == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    char *rings = ring->rings;
+
+    ring->sq_head = (_Atomic unsigned int*)(rings + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned int*)(rings + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int*)(rings + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (_Atomic unsigned int*)(rings + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned int*)(rings + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+    // Entries are always taken in order, so the indirection array maps each to itself
+
+    unsigned int *array = (unsigned int*)(rings + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    if (!(ring->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buffer_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register");
+        exit(EXIT_FAILURE);
+    }
+
+    ring->buffer_tail = 0;
+    for (unsigned int bid = 0; bid < URING_BUFFERS; bid++) {
+        uring_recycle(ring, bid);
+    }
+}
+
+/**
+ * Tear down the ring, which cancels whatever is left on it.  The loop waits for
+ * the requests of its connections first, so none of them can still reference
+ * their memory.
+ */
+static void uring_close(struct uring *ring) {
+
+    close(ring->fd);
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    munmap(ring->rings, ring->rings_size);
+    munmap(ring->buffer_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(ring->buffers);
+}
+
+/**
+ * Submit the queued entries, then wait until at least wait completions are posted.
+ * Returns early, leaving the caller to reap what was posted, if interrupted or
+ * if the completions overflowed the ring.
+ * @return 0 on success, -1 on error
+ */
+static int uring_enter(struct uring *ring, unsigned int wait) {
+
+    unsigned int submit = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) -
+            atomic_load_explicit(ring->sq_head, memory_order_acquire);
+
+    if (syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Make room for count submission entries, submitting the queued ones if the ring
+ * is too full.  Linked requests must be submitted together.
+ */
+static void uring_reserve(struct uring *ring, unsigned int count) {
+
+    unsigned int tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+
+    while (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) > ring->sq_entries - count) {
+        if (uring_enter(ring, 0) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Take the next submission entry, cleared.
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *ring) {
+
+    uring_reserve(ring, 1);
+
+    unsigned int tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+
+    return sqe;
+}
+
+static struct io_uring_sqe *uring_prep(struct uring *ring, int opcode, int fd, const void *addr,
+        unsigned int len, uint64_t offset, uint64_t user_data) {
+
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    return sqe;
+}
+
+/**
+ * Queue a request for a connection of a loop, which is kept until it completes.
+ */
+static struct io_uring_sqe *uring_prep_connection(struct connection *conn, enum uring_op op, int opcode,
+        int fd, const void *addr, unsigned int len, uint64_t offset) {
+
+    conn->inflight++;
+    conn->loop->pending++;
+
+    return uring_prep(&conn->loop->ring, opcode, fd, addr, len, offset, (uintptr_t)conn | op);
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+
+/**
+ * Append a packet from a connection of an io_uring loop: reserve its range and
+ * queue a write for each segment it spans, then queue the connection on the
+ * loop's appending list to be committed by uring_publish.  A spilled packet,
+ * with data NULL, is copied from the spill file right away.
+ * @return 0, or -1 once the history is frozen
+ */
+int uring_append(struct connection *conn, char *data, size_t len) {
+
+    size_t offset;
+
+    if (history_reserve(len, &offset) < 0) {
+        return -1;
+    }
+
+    conn->appending = true;
+    conn->append_data = data;
+    conn->append_len = len;
+    conn->append_offset = offset;
+    conn->append_written = 0;
+    conn->append_writes = 0;
+    conn->append_failed = false;
+
+    if (!data) {
+        conn->append_failed = history_copy_file(conn->spill_fd, len, offset) < 0;
+        conn->append_written = len;
+    }
+
+    for (size_t queued = 0; data && queued < len; ) {
+
+        size_t out = offset + queued;
+        size_t n = len - queued < segment_room(out) ? len - queued : segment_room(out);
+        int fd = segment_fd(out);
+
+        if (fd < 0) {
+            conn->append_failed = true;
+            break;
+        }
+
+        uring_prep_connection(conn, URING_WRITE, IORING_OP_WRITE, fd, data + queued, n, segment_offset(out));
+        conn->append_writes++;
+        queued += n;
+    }
+
+    TAILQ_INSERT_TAIL(&conn->loop->appending, conn, append_entries);
+
+    return 0;
+}
+#endif
+
+/**
+ * Close a connection no longer on its loop: shutting its socket down completes its
+ * receive and send, and it is freed once none of its requests is left and its
+ * last append has been committed.
+ */
+void uring_release(struct connection *conn) {
+
+    if (!conn->closing) {
+        conn->closing = true;
+        shutdown(conn->connection_fd, SHUT_RDWR);
+    }
+
+    if (conn->inflight == 0 && !conn->appending) {
+        connection_destroy(conn);
+    }
+}
+
+static struct io_uring_sqe *uring_send(struct connection *conn, int opcode, const void *addr, size_t len) {
+
+    struct io_uring_sqe *sqe = uring_prep_connection(conn, URING_SEND, opcode, conn->connection_fd,
+            addr, len, 0);
+
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    conn->sends++;
+    return sqe;
+}
+
+/**
+ * Queue the next send of the replay, like connection_flush.  Blocks copied from
+ * the data file are read by a request linked to its send, and up to
+ * URING_REPLAY_BLOCKS such pairs are chained through the one buffer so a large
+ * replay needs few trips around the loop.  REPLAY_SENDFILE copies as well since
+ * the ring has no sendfile.  The aesdchar driver is still read directly: the ring would hand
+ * each read to a worker thread, the driver having no way to do it without
+ * blocking.
+ * @return CONNECTION_DONE when nothing is left to send, CONNECTION_AGAIN while a
+ * send is queued, CONNECTION_CLOSE on error
+ */
+static enum connection_status uring_flush(struct connection *conn) {
+
+    while (conn->sends == 0) {
+
+        if (conn->replay_sent < conn->replay_len) {
+#ifndef USE_AESD_CHAR_DEVICE
+            // Chained sends only stop short on error, which cancels the rest
+
+            if (replay_source != REPLAY_MEMORY && replay_source != REPLAY_MMAP) {
+                return CONNECTION_CLOSE;
+            }
+#endif
+            uring_send(conn, IORING_OP_SEND, &conn->replay[conn->replay_sent],
+                    conn->replay_len - conn->replay_sent);
+            break;
+        }
+
+        if (!conn->replaying) {
+            return CONNECTION_DONE;
+        }
+
+#ifndef USE_AESD_CHAR_DEVICE
+        if (replay_source == REPLAY_MEMORY || replay_source == REPLAY_MMAP) {
+
+            if (conn->replay_pos == conn->replay_end) {
+                connection_replay_next(conn);
+                continue;
+            }
+
+            int iovcnt = connection_memlog_iov(conn, conn->iov);
+            if (iovcnt < 0) {
+                return CONNECTION_CLOSE;
+            }
+
+            memset(&conn->msg, 0, sizeof(conn->msg));
+            conn->msg.msg_iov = conn->iov;
+            conn->msg.msg_iovlen = iovcnt;
+
+            uring_send(conn, IORING_OP_SENDMSG, &conn->msg, 1);
+            break;
+        }
+#endif
+
+        // Buffers are only needed for a copied replay, so allocate on first use
+
+        if (!conn->replay && !(conn->replay = malloc(REPLAY_BUFFER_SIZE))) {
+            perror("malloc");
+            return CONNECTION_CLOSE;
+        }
+
+#ifdef USE_AESD_CHAR_DEVICE
+        ssize_t count = connection_replay_span(conn, REPLAY_BUFFER_SIZE);
+        if (count < 0) {
+            return CONNECTION_CLOSE;
+        }
+
+        ssize_t nread = read(conn->file_fd, conn->replay, count);
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return CONNECTION_CLOSE;
+        }
+
+        if (nread == 0) {
+            connection_replay_next(conn);
+        }
+
+        conn->replay_pos += nread;
+        conn->replay_len = nread;
+        conn->replay_sent = 0;
+#else
+        // The span stays within one segment, whose descriptor must outlive the chain
+
+        ssize_t count = connection_replay_span(conn, URING_REPLAY_BLOCKS * REPLAY_BUFFER_SIZE);
+        if (count < 0) {
+            return CONNECTION_CLOSE;
+        }
+
+        if (count == 0) {
+            connection_replay_next(conn);
+            continue;
+        }
+
+        // A short read breaks the link, which cancels the rest of the chain
+
+        uring_reserve(&conn->loop->ring, 2 * URING_REPLAY_BLOCKS);
+
+        struct io_uring_sqe *sqe = NULL;
+        for (ssize_t done = 0; done < count; done += REPLAY_BUFFER_SIZE) {
+            size_t len = count - done < REPLAY_BUFFER_SIZE ? count - done : REPLAY_BUFFER_SIZE;
+
+            if (sqe) {
+                sqe->flags = IOSQE_IO_LINK;
+            }
+            sqe = uring_prep_connection(conn, URING_READ, IORING_OP_READ, conn->file_fd,
+                    conn->replay, len, segment_offset(conn->replay_pos + done));
+            sqe->flags = IOSQE_IO_LINK;
+            sqe = uring_send(conn, IORING_OP_SEND, conn->replay, len);
+        }
+
+        conn->replay_pos += count;
+        conn->replay_len = count;
+        conn->replay_sent = 0;
+#endif
+    }
+
+    return CONNECTION_AGAIN;
+}
+
+/**
+ * Queue a receive into a buffer of the ring, no larger than the room left in
+ * buffer, where its data is copied.
+ */
+static void uring_receive(struct connection *conn) {
+
+    size_t room = conn->buffer_size - conn->buffer_len;
+
+    struct io_uring_sqe *sqe = uring_prep_connection(conn, URING_RECV, IORING_OP_RECV, conn->connection_fd,
+            NULL, room < URING_BUFFER_SIZE ? room : URING_BUFFER_SIZE, 0);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    conn->receiving = true;
+}
+
+/**
+ * Drive a connection of an io_uring event loop like connection_run, except that
+ * its receives, sends and appends are queued on the ring, and it is run again
+ * as they complete.  Packets are still processed while a send is queued, but
+ * not while the last one is being appended.
+ * @return CONNECTION_AGAIN or CONNECTION_CLOSE
+ */
+enum connection_status uring_run(struct connection *conn) {
+
+    while (true) {
+
+        enum connection_status status = uring_flush(conn);
+        if (status == CONNECTION_CLOSE) {
+            return status;
+        }
+        if (status == CONNECTION_DONE) {
+            connection_replied(conn);
+        }
+
+        if (conn->appending) {
+            return CONNECTION_AGAIN;
+        }
+
+#ifndef USE_AESD_CHAR_DEVICE
+        if (conn->commit_seq || conn->publish_end) {
+            status = conn->commit_seq ? connection_commit_wait(conn) : connection_publish_wait(conn);
+            if (status != CONNECTION_DONE) {
+                return status;
+            }
+            continue;
+        }
+#endif
+
+        if (connection_output_full(conn)) {
+            return CONNECTION_AGAIN;
+        }
+
+        int rc = connection_next_packet(conn);
+        if (rc < 0) {
+            return CONNECTION_CLOSE;
+        }
+        if (rc > 0) {
+            continue;
+        }
+
+        if (!conn->receiving) {
+            uring_receive(conn);
+        }
+
+        return CONNECTION_AGAIN;
+    }
+}
+
+/**
+ * Queue a multishot accept on the listening socket at server_fd, which posts one
+ * completion per connection until it fails.
+ */
+static void uring_arm_accept(struct event_loop *loop, int *server_fd) {
+
+    struct io_uring_sqe *sqe = uring_prep(&loop->ring, IORING_OP_ACCEPT, *server_fd, NULL, 0, 0,
+            (uintptr_t)server_fd);
+
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/**
+ * Stop accepting on server_fd, so that a socket handed over is only accepted on
+ * by the new server.  The cancellation completes with the ring as its user_data.
+ */
+static void uring_cancel_accept(struct event_loop *loop, int *server_fd) {
+
+    uring_prep(&loop->ring, IORING_OP_ASYNC_CANCEL, -1, server_fd, 0, 0, (uintptr_t)&loop->ring);
+}
+
+static void uring_arm_poll(struct event_loop *loop, int *fd, bool multishot) {
+
+    struct io_uring_sqe *sqe = uring_prep(&loop->ring, IORING_OP_POLL_ADD, *fd, NULL,
+            multishot ? IORING_POLL_ADD_MULTI : 0, 0, (uintptr_t)fd);
+
+    sqe->poll32_events = POLLIN;
+}
+
+/**
+ * Take a connection accepted on server_fd, the loop's shard or the Unix socket.
+ */
+static void uring_accept(struct event_loop *loop, int *server_fd, struct io_uring_cqe *cqe) {
+
+    struct sockaddr_storage address;
+    socklen_t addrlen = sizeof(address);
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && atomic_load(&accepting)) {
+        uring_arm_accept(loop, server_fd);
+    }
+
+    if (cqe->res < 0) {
+        if (cqe->res != -ECONNABORTED && cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            perror("accept");
+        }
+        return;
+    }
+
+    if (!atomic_load(&accepting)) {
+        close(cqe->res);
+        return;
+    }
+
+    // A multishot accept has nowhere to store the address
+
+    if (getpeername(cqe->res, (struct sockaddr*)&address, &addrlen) < 0) {
+        memset(&address, 0, sizeof(address));
+    }
+
+    struct connection *conn = connection_create(cqe->res, &address);
+    if (!conn) {
+        close(cqe->res);
+        return;
+    }
+
+    conn->loop = loop;
+    conn->notify_fd = loop->commit_fd;
+
+    LIST_INSERT_HEAD(&loop->connections, conn, entries);
+    event_loop_run(loop, conn);
+}
+
+/**
+ * Handle the completion of a request queued for conn, running it again once its
+ * receive or send is done.
+ */
+static void uring_complete(struct event_loop *loop, struct connection *conn, enum uring_op op,
+        struct io_uring_cqe *cqe) {
+
+    bool failed = false;
+    bool run = false;
+
+    conn->inflight--;
+    loop->pending--;
+
+    switch (op) {
+
+        case URING_RECV:
+            conn->receiving = false;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe->res > 0 && !conn->closing) {
+                    memcpy(&conn->buffer[conn->buffer_len], &loop->ring.buffers[(size_t)bid * URING_BUFFER_SIZE],
+                            cqe->res);
+                    connection_received(conn, cqe->res);
+                }
+                uring_recycle(&loop->ring, bid);
+            }
+            if (cqe->res < 0 && cqe->res != -ENOBUFS && !conn->closing) {
+                errno = -cqe->res;
+                perror("recv");
+            }
+            failed = cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS);
+            run = true;
+            break;
+
+        case URING_SEND:
+            conn->sends--;
+            if (cqe->res < 0) {
+                if (cqe->res != -ECANCELED && !conn->closing) {
+                    errno = -cqe->res;
+                    perror("send");
+                }
+                failed = true;
+                break;
+            }
+            if (replay_source == REPLAY_MEMORY || replay_source == REPLAY_MMAP) {
+                conn->replay_pos += cqe->res;
+            } else {
+                conn->replay_sent += cqe->res;
+            }
+            connection_sent(conn, cqe->res);
+            run = true;
+            break;
+
+        case URING_READ:
+            if (cqe->res < 0 && cqe->res != -ECANCELED) {
+                errno = -cqe->res;
+                perror("read");
+            }
+            break;
+
+        case URING_WRITE:
+            conn->append_writes--;
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                perror("write");
+                conn->append_failed = true;
+            } else {
+                conn->append_written += cqe->res;
+            }
+            break;
+    }
+
+    if (conn->closing) {
+        uring_release(conn);
+    } else if (failed) {
+        event_loop_close(loop, conn);
+    } else if (run) {
+        event_loop_run(loop, conn);
+    }
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+
+/**
+ * Commit the appends at the head of the appending list once their writes have
+ * completed, in the order their ranges were reserved.  Their connections then
+ * wait on the waiting list for their ranges to be published, as the ranges
+ * before them may still be written by other threads.
+ */
+static void uring_publish(struct event_loop *loop) {
+
+    struct connection *conn;
+
+    while ((conn = TAILQ_FIRST(&loop->appending)) && conn->append_writes == 0) {
+
+        int rc = conn->append_failed ? -1 : 0;
+
+        if (rc == 0 && conn->append_written < conn->append_len) {
+            fprintf(stderr, "short write of the history\n");
+            rc = -1;
+        }
+
+        TAILQ_REMOVE(&loop->appending, conn, append_entries);
+
+        if (conn->append_data) {
+            struct iovec iov = {
+                .iov_base = conn->append_data,
+                .iov_len = conn->append_len,
+            };
+            rc = history_commit(&iov, 1, conn->append_offset, rc);
+        } else {
+            rc = history_commit_file(conn->spill_fd, conn->append_len, conn->append_offset, rc);
+            close(conn->spill_fd);
+            conn->spill_fd = -1;
+            conn->spill_len = 0;
+        }
+
+        conn->appending = false;
+        conn->publish_end = conn->append_offset + conn->append_len;
+
+        if (conn->closing) {
+            uring_release(conn);
+        } else if (rc < 0) {
+            event_loop_close(loop, conn);
+        } else {
+            event_loop_run(loop, conn);
+        }
+    }
+}
+#endif
+
+/**
+ * Reap the posted completions, telling the loop's own from those of connections
+ * by their user_data.
+ * @return whether the commit thread notified the loop
+ */
+static bool uring_reap(struct event_loop *loop) {
+
+    struct uring *ring = &loop->ring;
+    unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    bool committed = false;
+
+    while (head != atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        void *data = (void*)(uintptr_t)cqe.user_data;
+
+        // Free the entry first, handling the completion may queue more requests
+
+        atomic_store_explicit(ring->cq_head, ++head, memory_order_release);
+
+        if (data == &loop->server_fd || data == &local_fd) {
+            uring_accept(loop, data, &cqe);
+        } else if (data == &shutdown_fd) {
+            atomic_store(&accepting, false);
+            uring_cancel_accept(loop, &loop->server_fd);
+            if (local_fd >= 0) {
+                uring_cancel_accept(loop, &local_fd);
+            }
+        } else if (data == &loop->ring || data == &close_fd) {
+            continue;
+        } else if (data == &loop->commit_fd) {
+            committed = true;
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                uring_arm_poll(loop, &loop->commit_fd, true);
+            }
+        } else if (data == &loop->timeout) {
+            loop->timing = false;
+        } else {
+            uring_complete(loop, (struct connection*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK),
+                    cqe.user_data & URING_OP_MASK, &cqe);
+        }
+    }
+
+    return committed;
+}
+
+/**
+ * Serve the loop's connections from its ring, each pass submitting everything they
+ * queued and waiting for completions with a single system call.  Once accepting
+ * is cleared, the loop exits as soon as its connections are closed, and once
+ * serving is, it closes them and waits for their requests.
+ */
+void *event_loop_thread(void *arg) {
+
+    struct event_loop *loop = (struct event_loop*)arg;
+
+    pin_thread(loop->index);
+
+    uring_arm_accept(loop, &loop->server_fd);
+    if (local_fd >= 0) {
+        uring_arm_accept(loop, &local_fd);
+    }
+    uring_arm_poll(loop, &shutdown_fd, false);
+    uring_arm_poll(loop, &close_fd, false);
+    if (loop->commit_fd >= 0) {
+        uring_arm_poll(loop, &loop->commit_fd, true);
+    }
+
+    while (atomic_load(&accepting) || !LIST_EMPTY(&loop->connections) || loop->pending > 0 ||
+            !TAILQ_EMPTY(&loop->appending)) {
+
+        // Wake up once a second while there are stalled connections to expire
+
+        if (!LIST_EMPTY(&loop->stalled) && !loop->timing) {
+            loop->timeout.tv_sec = 1;
+            uring_prep(&loop->ring, IORING_OP_TIMEOUT, -1, &loop->timeout, 1, 0, (uintptr_t)&loop->timeout);
+            loop->timing = true;
+        }
+
+        if (uring_enter(&loop->ring, 1) < 0) {
+            break;
+        }
+
+        bool committed = uring_reap(loop);
+
+#ifndef USE_AESD_CHAR_DEVICE
+        uring_publish(loop);
+#endif
+
+        // Waiting connections may be closed, so only run them once no completion refers to them
+
+        if (committed) {
+            event_loop_commit(loop);
+        }
+
+        if (!LIST_EMPTY(&loop->stalled)) {
+            event_loop_expire(loop);
+        }
+
+        while (!atomic_load(&serving) && !LIST_EMPTY(&loop->connections)) {
+            event_loop_close(loop, LIST_FIRST(&loop->connections));
+        }
+    }
+
+    // Cancel the accepts right away, closing the ring leaves that to the kernel for later
+
+    uring_enter(&loop->ring, 0);
+
+    event_loop_exit();
+
+    return loop;
+}
+
+void event_loop_setup(struct event_loop *loop) {
+
+    TAILQ_INIT(&loop->appending);
+    uring_open(&loop->ring);
+}
+
+void event_loop_teardown(struct event_loop *loop) {
+
+    uring_close(&loop->ring);
+}
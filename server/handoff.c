@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+#include "handoff.h"
+#include "history.h"
+#include "metrics.h"
+
+#define HANDOFF_MAGIC 0x61657364
+#define HANDOFF_VERSION 2
+#define HANDOFF_TIMEOUT 5
+#define HANDOFF_MAX_FDS 253
+
+struct handoff handoff = {
+    .server_fd = -1,
+    .previous_fd = -1,
+    .next_fd = -1,
+};
+
+#ifndef USE_AESD_CHAR_DEVICE
+
+static int read_all(int fd, void *data, size_t len) {
+
+    while (len > 0) {
+        ssize_t nread = read(fd, data, len);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+        if (nread == 0) {
+            fprintf(stderr, "unexpected end of file\n");
+            return -1;
+        }
+        data = (char*)data + nread;
+        len -= nread;
+    }
+
+    return 0;
+}
+
+/**
+ * Write count values as the 64-bit words of the handoff.
+ * @return 0 on success, -1 on error
+ */
+static int write_words(int fd, const size_t *values, size_t count) {
+
+    uint64_t words[REPLAY_BUFFER_SIZE / sizeof(uint64_t)];
+
+    while (count > 0) {
+
+        size_t n = count < sizeof(words) / sizeof(words[0]) ? count : sizeof(words) / sizeof(words[0]);
+
+        for (size_t i = 0; i < n; i++) {
+            words[i] = values[i];
+        }
+
+        if (write_line(fd, (char*)words, n * sizeof(uint64_t)) < 0) {
+            return -1;
+        }
+
+        values += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Read count values sent by write_words.
+ * @return 0 on success, -1 on error
+ */
+static int read_words(int fd, size_t *values, size_t count) {
+
+    uint64_t words[REPLAY_BUFFER_SIZE / sizeof(uint64_t)];
+
+    while (count > 0) {
+
+        size_t n = count < sizeof(words) / sizeof(words[0]) ? count : sizeof(words) / sizeof(words[0]);
+
+        if (read_all(fd, words, n * sizeof(uint64_t)) < 0) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            values[i] = words[i];
+        }
+
+        values += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Take over the state of the history from the server handing over, sent after
+ * its descriptors.  It is only used for a log of the same kind, segmented or
+ * not, as the one this server was asked for.
+ * @return true if taken over, false to load the history from its files
+ */
+bool handoff_load(void) {
+
+    struct handoff_header *header = &handoff.header;
+    size_t count = header->next - header->first;
+    size_t *segments = NULL;
+    bool loaded = false;
+
+    if (!header->history || (header->segment_size != 0) != segment_log.enabled) {
+        goto out;
+    }
+
+    if (!segment_log.enabled) {
+
+        // The index arrives as it is kept, block by block
+
+        for (size_t line = 0; line < header->lines; line += LINE_INDEX_BLOCK_SIZE) {
+
+            size_t block = line / LINE_INDEX_BLOCK_SIZE;
+            size_t n = header->lines - line;
+            if (n > LINE_INDEX_BLOCK_SIZE) {
+                n = LINE_INDEX_BLOCK_SIZE;
+            }
+
+            if (block >= LINE_INDEX_MAX_BLOCKS) {
+                fprintf(stderr, "line index full\n");
+                goto out;
+            }
+
+            if (!line_index.blocks[block] &&
+                    !(line_index.blocks[block] = malloc(LINE_INDEX_BLOCK_SIZE * sizeof(size_t)))) {
+                perror("malloc");
+                goto out;
+            }
+
+            if (read_words(handoff.previous_fd, line_index.blocks[block], n) < 0) {
+                goto out;
+            }
+        }
+
+    } else {
+
+        if (count > SEGMENT_MAX) {
+            fprintf(stderr, "cannot take over %zu segments\n", count);
+            goto out;
+        }
+
+        if (count > 0 && !(segments = calloc(count, 2 * sizeof(size_t)))) {
+            perror("calloc");
+            goto out;
+        }
+
+        if (read_words(handoff.previous_fd, segments, count * 2) < 0) {
+            goto out;
+        }
+
+        if (header->segment_size != segment_log.size) {
+            syslog(LOG_INFO, "Keeping segment size %zu of the existing log", (size_t)header->segment_size);
+            segment_log.size = header->segment_size;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            segment_slot(header->first + i)->line = segments[2 * i];
+            atomic_store(&segment_slot(header->first + i)->line_offset, segments[2 * i + 1]);
+        }
+
+        segment_log.first = header->first;
+        segment_log.synced = header->first;
+        atomic_store(&segment_log.next, header->next);
+        atomic_store(&segment_log.start, header->start);
+    }
+
+    line_index.lines = header->lines;
+    atomic_store(&line_index.published, line_index.lines);
+
+    // Nothing left to index, but the memlog is still loaded from the files
+
+    if (replay_source == REPLAY_MEMORY) {
+        history_scan(segment_log.enabled ? header->first * segment_log.size : 0, header->tail, header->tail);
+    }
+
+    atomic_init(&append_log.tail, header->tail);
+    atomic_init(&append_log.published, header->tail);
+
+    syslog(LOG_INFO, "Took over %zu bytes and %zu lines of history", (size_t)header->tail,
+            (size_t)header->lines);
+    loaded = true;
+
+out:
+
+    free(segments);
+    close(handoff.previous_fd);
+    handoff.previous_fd = -1;
+
+    return loaded;
+}
+#endif
+
+/**
+ * Send the listening sockets to the server asking to take over on fd, then wait
+ * up to HANDOFF_TIMEOUT for it to acknowledge them.  Nothing changes here before
+ * that, so this server simply goes on if it fails.
+ * @return 0 once acknowledged, -1 on error
+ */
+static int handoff_send_sockets(int fd) {
+
+    struct handoff_header header = {
+        .magic = HANDOFF_MAGIC,
+        .version = HANDOFF_VERSION,
+        .shards = server_count,
+        .local = local_fd >= 0,
+        .metrics = metrics.enabled,
+#ifndef USE_AESD_CHAR_DEVICE
+        .history = true,
+#endif
+    };
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = &header,
+        .iov_len = offsetof(struct handoff_header, tail),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+    };
+    struct timeval timeout = {
+        .tv_sec = HANDOFF_TIMEOUT,
+    };
+    int fds[HANDOFF_MAX_FDS];
+    int nfds = 0;
+    char ack;
+
+    for (int i = 0; i < listener_count(); i++) {
+        fds[nfds++] = listener_fd(i);
+    }
+    if (metrics.enabled) {
+        fds[nfds++] = metrics.server_fd;
+    }
+
+    memset(&control, 0, sizeof(control));
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)iov.iov_len) {
+        perror("sendmsg");
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror("setsockopt");
+        return -1;
+    }
+
+    if (recv(fd, &ack, 1, 0) != 1) {
+        fprintf(stderr, "%s: sockets handed over not acknowledged\n", handoff.path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Send the state of the history to the server that acknowledged the sockets on
+ * next_fd, once accepting has stopped.  The history is frozen first, so that
+ * nothing is appended after it, while the connections left go on being served.
+ * If this fails midway, the new server is cut off to load the history from its
+ * files, which are complete once frozen.
+ */
+static void handoff_send_history(void) {
+
+#ifndef USE_AESD_CHAR_DEVICE
+    struct handoff_header header;
+    size_t rest = offsetof(struct handoff_header, tail);
+
+    header.tail = history_freeze();
+
+    // What the commit thread has written is synced as on its stop
+
+    if (commit_log.enabled) {
+        history_sync();
+    }
+
+    mutex_lock(&segment_log.lock);
+
+    if (segment_log.enabled) {
+        manifest_write();
+    }
+
+    header.lines = line_index.lines;
+    header.segment_size = segment_log.enabled ? segment_log.size : 0;
+    header.first = segment_log.first;
+    header.next = atomic_load(&segment_log.next);
+    header.start = atomic_load(&segment_log.start);
+
+    pthread_mutex_unlock(&segment_log.lock);
+
+    if (write_line(handoff.next_fd, (char*)&header + rest, sizeof(header) - rest) < 0) {
+        goto fail;
+    }
+
+    if (!segment_log.enabled) {
+        for (size_t line = 0; line < header.lines; line += LINE_INDEX_BLOCK_SIZE) {
+            size_t n = header.lines - line;
+            if (n > LINE_INDEX_BLOCK_SIZE) {
+                n = LINE_INDEX_BLOCK_SIZE;
+            }
+            if (write_words(handoff.next_fd, line_index.blocks[line / LINE_INDEX_BLOCK_SIZE], n) < 0) {
+                goto fail;
+            }
+        }
+    } else {
+        for (size_t index = header.first; index < header.next; index++) {
+            size_t entry[2] = {
+                segment_slot(index)->line,
+                atomic_load(&segment_slot(index)->line_offset),
+            };
+            if (write_words(handoff.next_fd, entry, 2) < 0) {
+                goto fail;
+            }
+        }
+    }
+#endif
+
+    syslog(LOG_INFO, "Handed over to the new server");
+    return;
+
+#ifndef USE_AESD_CHAR_DEVICE
+fail:
+
+    syslog(LOG_ERR, "Handed over the sockets only, the new server loads the history from its files");
+    shutdown(handoff.next_fd, SHUT_RDWR);
+#endif
+}
+
+/**
+ * Take the connection of a new server asking to take over and hand over right
+ * away, stopping accepting once it has the sockets.  Only the first one that
+ * acknowledges them is taken.
+ */
+void handoff_accept(void) {
+
+    int client_fd = accept4(handoff.server_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (client_fd < 0) {
+        if (errno != ECONNABORTED && errno != EINTR) {
+            perror("accept4");
+        }
+        return;
+    }
+
+    if (!atomic_load(&accepting) || handoff.next_fd >= 0 || listener_count() + metrics.enabled > HANDOFF_MAX_FDS) {
+        close(client_fd);
+        return;
+    }
+
+    syslog(LOG_INFO, "Handing over to a new server");
+
+    if (handoff_send_sockets(client_fd) < 0) {
+        syslog(LOG_ERR, "Handoff failed, going on serving");
+        close(client_fd);
+        return;
+    }
+
+    handoff.next_fd = client_fd;
+    stop_accepting();
+
+    handoff_send_history();
+}
+
+/**
+ * Connect to the server at handoff.path, if one is running, and wait for it to
+ * hand over its descriptors, which it does as soon as it stops accepting.  The
+ * state of the history follows on previous_fd, for history_load.  Without a
+ * server there, or if it gives up or has not handed over within HANDOFF_TIMEOUT
+ * seconds, the sockets are opened afresh and the history loaded from its files.
+ */
+void handoff_receive(void) {
+
+    struct sockaddr_un address;
+    struct handoff_header *header = &handoff.header;
+    struct timeval timeout = {
+        .tv_sec = HANDOFF_TIMEOUT,
+    };
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = header,
+        .iov_len = sizeof(*header),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    int fds[HANDOFF_MAX_FDS];
+    size_t nfds = 0;
+    ssize_t nread;
+
+    unix_address(&address, handoff.path);
+
+    if ((handoff.previous_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (connect(handoff.previous_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+        close(handoff.previous_fd);
+        handoff.previous_fd = -1;
+        return;
+    }
+
+    // Also bounds the reads of the history state that follows
+
+    if (setsockopt(handoff.previous_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror("setsockopt");
+    }
+
+    while ((nread = recvmsg(handoff.previous_fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+
+    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        fprintf(stderr, "%s: nothing handed over within %d s\n", handoff.path, HANDOFF_TIMEOUT);
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (nread > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+
+    if (nread < (ssize_t)offsetof(struct handoff_header, tail) || header->magic != HANDOFF_MAGIC ||
+            header->shards == 0 || nfds != header->shards + header->local + header->metrics) {
+        fprintf(stderr, "%s: no sockets handed over\n", handoff.path);
+        for (size_t i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        close(handoff.previous_fd);
+        handoff.previous_fd = -1;
+        return;
+    }
+
+    // From the acknowledgement on, the previous server stops accepting and this one
+    // takes over
+
+    char ack = 1;
+
+    if (send(handoff.previous_fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+        fprintf(stderr, "%s: could not acknowledge the sockets handed over\n", handoff.path);
+        for (size_t i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        close(handoff.previous_fd);
+        handoff.previous_fd = -1;
+        return;
+    }
+
+    if ((int)header->shards != server_count) {
+        syslog(LOG_INFO, "Keeping the %u listening sockets handed over", header->shards);
+    }
+
+    // The history state is laid out differently by other versions
+
+    if (header->version != HANDOFF_VERSION) {
+        syslog(LOG_INFO, "Loading the history handed over by version %u from its files", header->version);
+        header->history = false;
+    }
+
+#ifndef USE_AESD_CHAR_DEVICE
+    if (header->history && (size_t)nread < sizeof(*header) &&
+            read_all(handoff.previous_fd, (char*)header + nread, sizeof(*header) - nread) < 0) {
+        header->history = false;
+    }
+#endif
+
+    server_count = header->shards;
+    if (!(server_fds = calloc(server_count, sizeof(int)))) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(server_fds, fds, server_count * sizeof(int));
+    nfds = server_count;
+
+    // Sockets not asked for any more are dropped, the others keep their address
+
+    if (header->local) {
+        if (local_path) {
+            local_fd = fds[nfds];
+        } else {
+            close(fds[nfds]);
+        }
+        nfds++;
+    }
+
+    if (header->metrics) {
+        if (metrics.enabled) {
+            metrics.server_fd = fds[nfds];
+        } else {
+            close(fds[nfds]);
+        }
+    }
+
+    // Only io_uring expects its listening sockets blocking, the others set O_NONBLOCK themselves
+
+    for (int i = 0; i < listener_count(); i++) {
+        int flags = fcntl(listener_fd(i), F_GETFL);
+        if (flags < 0 || fcntl(listener_fd(i), F_SETFL, flags & ~O_NONBLOCK) < 0) {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    close(handoff.previous_fd);
+    handoff.previous_fd = -1;
+#endif
+}
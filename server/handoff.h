@@ -0,0 +1,66 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HANDOFF_DRAIN_TIMEOUT 30
+
+/**
+ * Sent by a server handing over in two parts.  The fields before tail go along
+ * with its descriptors: the listening shards, then the Unix socket and the
+ * metrics socket if it has them.  Once the new server acknowledges them with a
+ * byte, the rest follows in the file build, then the history as 64-bit words,
+ * the line index of an unsegmented log or the first line of each segment of a
+ * segmented one.  Every field has a fixed width, and those before tail keep
+ * their place in later versions, so the sockets are taken over from any version
+ * but the history state only from the same one, the history being loaded from
+ * its files otherwise.
+ */
+struct handoff_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t shards;
+    uint8_t local;
+    uint8_t metrics;
+    uint8_t history;
+    uint8_t reserved;
+    uint64_t tail;
+    uint64_t lines;
+    uint64_t segment_size;
+    uint64_t first;
+    uint64_t next;
+    uint64_t start;
+};
+
+/**
+ * Hot restart.  A server given -H listens on path, and a new one given the same
+ * path connects there first.  The running server then sends its listening
+ * sockets, and only once the new server has acknowledged them stops accepting,
+ * freezes the history and sends its state over next_fd.  Clients queue in the
+ * listen backlogs rather than being refused, and the new server need not scan
+ * the history.  That one reads them from previous_fd, then listens on path in
+ * turn, while the previous server serves the connections it has left until they
+ * close or try to append.  A handoff failing before the acknowledgement leaves
+ * the running server as it was, and one failing after it the new server loading
+ * the history from its files.  With required, a new server that is not handed
+ * over exits rather than start afresh.
+ */
+struct handoff {
+    char *path;
+    bool required;
+    int server_fd;
+    int previous_fd;
+    int next_fd;
+    struct handoff_header header;
+};
+
+extern struct handoff handoff;
+
+#ifndef USE_AESD_CHAR_DEVICE
+bool handoff_load(void);
+#endif
+void handoff_accept(void);
+void handoff_receive(void);
+
+#endif /* HANDOFF_H */
@@ -0,0 +1,1755 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "aesdsocket.h"
+#include "history.h"
+#include "connection.h"
+#include "handoff.h"
+
+#define APPEND_RANGE_LINES 8
+#define NEWLINE_SCAN_BLOCK 64
+#define MAP_WINDOW_SIZE (64 * 1024 * 1024)
+#define MAP_MAX_WINDOWS 65536
+#define MANIFEST_SUFFIX ".manifest"
+#define HISTORY_FROZEN (SIZE_MAX - SIZE_MAX / 2)
+
+/**
+ * A range of the history its writer is done with, with the offset just past each
+ * of its newlines, to be indexed once the ranges before it are published too.
+ * The lines of a range whose write failed are not indexed.
+ */
+struct append_range {
+    TAILQ_ENTRY(append_range) entries;
+    size_t offset;
+    size_t end;
+    bool failed;
+    size_t nlines;
+    size_t size;
+    size_t *lines;
+};
+
+struct append_log append_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .published_cond = PTHREAD_COND_INITIALIZER,
+    .completed = TAILQ_HEAD_INITIALIZER(append_log.completed),
+};
+
+struct segment_log segment_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .size = SIZE_MAX,
+};
+
+struct memlog memlog;
+
+/**
+ * Read-only shared mappings of the history for REPLAY_MMAP, so that replies are
+ * sent straight from the page cache.  A window covers a whole segment of a
+ * segmented log, or MAP_WINDOW_SIZE bytes of the data file.  It is mapped on
+ * first use and kept until exit, and may reach past the end of its file, as
+ * only published bytes are ever read from it.
+ */
+struct history_maps {
+    _Atomic(char*) windows[MAP_MAX_WINDOWS];
+};
+
+struct history_maps history_maps;
+
+struct line_index line_index;
+
+/**
+ * Iterator over the newlines of data.  With SSE2 the bytes are compared
+ * NEWLINE_SCAN_BLOCK at a time into mask, one bit per newline from offset,
+ * which on the short lines of a history is faster than a memchr per line.
+ * Elsewhere it is memchr from offset, itself vectorized by the C library.
+ */
+struct newline_scan {
+    const char *data;
+    size_t len;
+    size_t offset;
+#ifdef __SSE2__
+    uint64_t mask;
+#endif
+};
+
+struct commit_request {
+    STAILQ_ENTRY(commit_request) next;
+    int notify_fd;
+    size_t len;
+    char data[];
+};
+
+struct commit_log commit_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .submitted_cond = PTHREAD_COND_INITIALIZER,
+    .committed_cond = PTHREAD_COND_INITIALIZER,
+    .pending = STAILQ_HEAD_INITIALIZER(commit_log.pending),
+};
+
+static size_t segment_index(size_t offset) {
+
+    return offset / segment_log.size;
+}
+
+/**
+ * Whether len bytes at offset of the history fit in the memlog.
+ */
+static bool memlog_fits(size_t offset, size_t len) {
+
+    return len == 0 || (offset + len - 1) / MEMLOG_CHUNK_SIZE < MEMLOG_MAX_CHUNKS;
+}
+
+/**
+ * Copy data to the memlog at its offset in the history, which must be in a range
+ * reserved by the caller.
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int memlog_write(const char *data, size_t len, size_t offset) {
+
+    size_t copied = 0;
+
+    while (copied < len) {
+
+        size_t chunk = offset / MEMLOG_CHUNK_SIZE;
+        size_t chunk_offset = offset % MEMLOG_CHUNK_SIZE;
+        size_t n = MEMLOG_CHUNK_SIZE - chunk_offset;
+
+        if (chunk >= MEMLOG_MAX_CHUNKS) {
+            fprintf(stderr, "memlog full\n");
+            return -1;
+        }
+
+        char *block = atomic_load_explicit(&memlog.chunks[chunk], memory_order_acquire);
+
+        if (!block) {
+
+            char *expected = NULL;
+
+            if (!(block = malloc(MEMLOG_CHUNK_SIZE))) {
+                perror("malloc");
+                return -1;
+            }
+
+            // Another writer may have allocated the chunk meanwhile
+
+            if (!atomic_compare_exchange_strong(&memlog.chunks[chunk], &expected, block)) {
+                free(block);
+                block = expected;
+            }
+        }
+
+        if (n > len - copied) {
+            n = len - copied;
+        }
+
+        memcpy(&block[chunk_offset], &data[copied], n);
+        offset += n;
+        copied += n;
+    }
+
+    return 0;
+}
+
+#ifdef __SSE2__
+
+/**
+ * Bit mask of the newlines among the NEWLINE_SCAN_BLOCK bytes of the scan at its
+ * offset, the last block being padded.
+ */
+static uint64_t newline_mask(struct newline_scan *scan) {
+
+    const char *p = &scan->data[scan->offset];
+    char tail[NEWLINE_SCAN_BLOCK];
+    const __m128i newline = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+
+    if (scan->len - scan->offset < NEWLINE_SCAN_BLOCK) {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p, scan->len - scan->offset);
+        p = tail;
+    }
+
+    for (int i = 0; i < NEWLINE_SCAN_BLOCK / 16; i++) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)&p[16 * i]);
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) << (16 * i);
+    }
+
+    return mask;
+}
+#endif
+
+static void newline_scan_init(struct newline_scan *scan, const char *data, size_t len) {
+
+    scan->data = data;
+    scan->len = len;
+    scan->offset = 0;
+#ifdef __SSE2__
+    scan->mask = len > 0 ? newline_mask(scan) : 0;
+#endif
+}
+
+/**
+ * Find the next newline of the scan.
+ * @return the offset just past it, or 0 if there is none left
+ */
+static size_t newline_scan_next(struct newline_scan *scan) {
+
+#ifdef __SSE2__
+    while (scan->mask == 0) {
+        scan->offset += NEWLINE_SCAN_BLOCK;
+        if (scan->offset >= scan->len) {
+            return 0;
+        }
+        scan->mask = newline_mask(scan);
+    }
+
+    size_t end = scan->offset + __builtin_ctzll(scan->mask) + 1;
+    scan->mask &= scan->mask - 1;
+
+    return end;
+#else
+    const char *p = memchr(&scan->data[scan->offset], '\n', scan->len - scan->offset);
+    if (!p) {
+        return 0;
+    }
+
+    scan->offset = p - scan->data + 1;
+
+    return scan->offset;
+#endif
+}
+
+/**
+ * Record a newline ending just before end.  Called when publishing the range
+ * holding it, with the append log lock held or before the server starts.  The
+ * new entry becomes visible once line_index.published is advanced.
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int line_index_add(size_t end) {
+
+    size_t block = line_index.lines / LINE_INDEX_BLOCK_SIZE;
+
+    // Segmented logs only record the first line starting after each segment's newlines
+
+    if (segment_log.enabled) {
+
+        struct segment *segment = segment_slot(segment_index(end - 1));
+
+        line_index.lines++;
+
+        if (atomic_load_explicit(&segment->line_offset, memory_order_relaxed) == SIZE_MAX) {
+            segment->line = line_index.lines;
+            atomic_store_explicit(&segment->line_offset, end, memory_order_release);
+        }
+        return 0;
+    }
+
+    if (block >= LINE_INDEX_MAX_BLOCKS) {
+        fprintf(stderr, "line index full\n");
+        return -1;
+    }
+
+    if (!line_index.blocks[block] &&
+            !(line_index.blocks[block] = malloc(LINE_INDEX_BLOCK_SIZE * sizeof(size_t)))) {
+        perror("malloc");
+        return -1;
+    }
+
+    line_index.blocks[block][line_index.lines % LINE_INDEX_BLOCK_SIZE] = end;
+    line_index.lines++;
+
+    return 0;
+}
+
+/**
+ * Record the newlines of data, which starts at offset in the history, while
+ * loading it.
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int line_index_append(const char *data, size_t len, size_t offset) {
+
+    struct newline_scan scan;
+    size_t next;
+
+    newline_scan_init(&scan, data, len);
+
+    while ((next = newline_scan_next(&scan)) > 0) {
+        if (line_index_add(offset + next) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void segment_path(char *path, size_t index) {
+
+    if (segment_log.enabled) {
+        snprintf(path, PATH_MAX, "%s.%06zu", filename, index);
+    } else {
+        snprintf(path, PATH_MAX, "%s", filename);
+    }
+}
+
+/**
+ * Map the window of the history holding offset, if not mapped yet.
+ * @return the address of offset, with *len bytes mapped from there, or NULL on
+ * error
+ */
+const char *history_map(size_t offset, size_t *len) {
+
+    size_t size = segment_log.enabled ? segment_log.size : MAP_WINDOW_SIZE;
+    size_t window = offset / size;
+    char path[PATH_MAX];
+
+    if (window >= MAP_MAX_WINDOWS) {
+        fprintf(stderr, "history too large to map\n");
+        return NULL;
+    }
+
+    char *base = atomic_load_explicit(&history_maps.windows[window], memory_order_acquire);
+
+    if (!base) {
+
+        segment_path(path, segment_index(offset));
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror("open");
+            return NULL;
+        }
+
+        base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, segment_offset(window * size));
+        close(fd);
+
+        if (base == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+
+        // Another thread may have mapped the window meanwhile
+
+        char *expected = NULL;
+        if (!atomic_compare_exchange_strong(&history_maps.windows[window], &expected, base)) {
+            munmap(base, size);
+            base = expected;
+        }
+    }
+
+    *len = size - offset % size;
+
+    return &base[offset % size];
+}
+
+/**
+ * Make *fd a read fd of the segment holding offset, where *index is the segment
+ * *fd has open, if any.
+ * @return 0 on success, -1 with errno set on error, ENOENT if it was dropped
+ */
+int segment_open_read(int *fd, size_t *index, size_t offset) {
+
+    char path[PATH_MAX];
+
+    if (*fd >= 0 && *index == segment_index(offset)) {
+        return 0;
+    }
+
+    if (*fd >= 0) {
+        close(*fd);
+    }
+
+    *index = segment_index(offset);
+    segment_path(path, *index);
+
+    return (*fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ? -1 : 0;
+}
+
+/**
+ * Replace the manifest by one listing the present segments.  It is written
+ * aside and renamed over the old one, so a crash leaves either of them.
+ * Called with the segment lock held.
+ */
+void manifest_write(void) {
+
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    size_t next = atomic_load(&segment_log.next);
+
+    snprintf(path, sizeof(path), "%s%s", filename, MANIFEST_SUFFIX);
+    snprintf(tmp, sizeof(tmp), "%s%s.tmp", filename, MANIFEST_SUFFIX);
+
+    FILE *file = fopen(tmp, "we");
+    if (!file) {
+        perror("fopen");
+        return;
+    }
+
+    fprintf(file, "segments %zu\n", segment_log.size);
+
+    for (size_t index = segment_log.first; index < next; index++) {
+
+        struct segment *segment = segment_slot(index);
+        size_t line_offset = atomic_load_explicit(&segment->line_offset, memory_order_acquire);
+
+        if (line_offset == SIZE_MAX) {
+            fprintf(file, "%zu -\n", index);
+        } else {
+            fprintf(file, "%zu %zu %zu\n", index, segment->line, line_offset);
+        }
+    }
+
+    if (fflush(file) != 0 || fdatasync(fileno(file)) < 0) {
+        perror("fdatasync");
+    }
+
+    if (fclose(file) != 0) {
+        perror("fclose");
+        return;
+    }
+
+    if (rename(tmp, path) < 0) {
+        perror("rename");
+    }
+}
+
+/**
+ * Create the segment following the newest one.  Called with the segment lock held.
+ * @return 0 on success, -1 on error
+ */
+static int segment_create(void) {
+
+    char path[PATH_MAX];
+    size_t index = atomic_load(&segment_log.next);
+    struct segment *segment = segment_slot(index);
+
+    if (index - segment_log.first >= SEGMENT_MAX) {
+        fprintf(stderr, "too many segments\n");
+        return -1;
+    }
+
+    segment_path(path, index);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    // Segments are filled by concurrent pwrites in any order, reserve their blocks up
+    // front.  A file system without fallocate allocates them as they are written,
+    // while one without the space for them fails the segment now rather than midway.
+
+    if (segment_log.enabled && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, segment_log.size) < 0 &&
+            errno != EOPNOTSUPP) {
+        perror("fallocate");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    segment->line = 0;
+    atomic_store(&segment->line_offset, index == 0 ? 0 : SIZE_MAX);
+    atomic_store_explicit(&segment->fd, fd, memory_order_release);
+    atomic_store_explicit(&segment_log.next, index + 1, memory_order_release);
+
+    return 0;
+}
+
+/**
+ * Write fd of the segment holding offset, creating the segments up to it.  A
+ * writer's range is never dropped before it is published, so the fd stays open
+ * while it is used.
+ * @return the fd, or -1 on error
+ */
+int segment_fd(size_t offset) {
+
+    size_t index = segment_index(offset);
+    struct segment *segment = segment_slot(index);
+    int fd;
+
+    if (index < atomic_load_explicit(&segment_log.next, memory_order_acquire) &&
+            (fd = atomic_load_explicit(&segment->fd, memory_order_acquire)) >= 0) {
+        return fd;
+    }
+
+    mutex_lock(&segment_log.lock);
+
+    bool created = false;
+
+    while (atomic_load(&segment_log.next) <= index && segment_create() == 0) {
+        created = true;
+    }
+
+    if (created && segment_log.enabled) {
+        manifest_write();
+    }
+
+    // Segments present at startup are only opened for writing when written to
+
+    fd = -1;
+
+    if (index >= segment_log.first && index < atomic_load(&segment_log.next) &&
+            (fd = atomic_load(&segment->fd)) < 0) {
+
+        char path[PATH_MAX];
+        segment_path(path, index);
+
+        if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+            perror("open");
+        } else {
+            atomic_store_explicit(&segment->fd, fd, memory_order_release);
+        }
+    }
+
+    pthread_mutex_unlock(&segment_log.lock);
+
+    return fd;
+}
+
+/**
+ * Offset of the oldest line start recorded in segment index or later, or SIZE_MAX.
+ * Called with the segment lock held.
+ */
+static size_t segment_first_line(size_t index) {
+
+    size_t next = atomic_load(&segment_log.next);
+
+    for (; index < next; index++) {
+        size_t line_offset = atomic_load_explicit(&segment_slot(index)->line_offset, memory_order_acquire);
+        if (line_offset != SIZE_MAX) {
+            return line_offset;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+/**
+ * Drop the oldest segments for as long as the lines left after them still hold
+ * retain_bytes, or their last write is older than retain_age.  Run by the
+ * housekeeper.  A segment is only dropped once fully published and when a
+ * later segment holds the start of a line, replays then start from that line.
+ * The start moves before the file is removed, so a replay finding the file gone
+ * knows to move on.
+ */
+void segment_retain(void) {
+
+    time_t now = time(NULL);
+    bool dropped = false;
+
+    mutex_lock(&segment_log.lock);
+
+    size_t published = atomic_load_explicit(&append_log.published, memory_order_acquire);
+
+    while (segment_log.first + 1 < atomic_load(&segment_log.next)) {
+
+        char path[PATH_MAX];
+        struct stat st;
+        size_t index = segment_log.first;
+        size_t end = (index + 1) * segment_log.size;
+        size_t start = segment_first_line(index + 1);
+
+        if (end > published || start > published) {
+            break;
+        }
+
+        segment_path(path, index);
+
+        bool excess = segment_log.retain_bytes && published - start >= segment_log.retain_bytes;
+        bool expired = segment_log.retain_age && stat(path, &st) == 0 &&
+                st.st_mtime + segment_log.retain_age <= now;
+
+        if (!excess && !expired) {
+            break;
+        }
+
+        atomic_store_explicit(&segment_log.start, start, memory_order_release);
+
+        int fd = atomic_exchange(&segment_slot(index)->fd, -1);
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (unlink(path) < 0) {
+            perror("unlink");
+        }
+
+        segment_log.first++;
+        dropped = true;
+
+        syslog(LOG_DEBUG, "Dropped segment %zu", index);
+    }
+
+    if (dropped) {
+        manifest_write();
+    }
+
+    pthread_mutex_unlock(&segment_log.lock);
+}
+
+/**
+ * Offset in the history where line starts, counting from 0, or SIZE_MAX for a
+ * line past the last published one.  Without the full index of an unsegmented
+ * log, the newlines are counted from the newest line recorded at or before it,
+ * which is in the same segment.  Lines that were dropped start at the oldest
+ * line left.
+ */
+size_t line_index_offset(size_t line) {
+
+    size_t lines = atomic_load_explicit(&line_index.published, memory_order_acquire);
+
+    if (line > lines) {
+        return SIZE_MAX;
+    }
+
+    if (!segment_log.enabled) {
+
+        if (line == 0) {
+            return 0;
+        }
+
+        line--;
+        return line_index.blocks[line / LINE_INDEX_BLOCK_SIZE][line % LINE_INDEX_BLOCK_SIZE];
+    }
+
+    size_t end = atomic_load_explicit(&append_log.published, memory_order_acquire);
+    size_t offset = SIZE_MAX;
+    size_t count = 0;
+
+    mutex_lock(&segment_log.lock);
+
+    for (size_t index = atomic_load(&segment_log.next); index-- > segment_log.first; ) {
+
+        struct segment *segment = segment_slot(index);
+        size_t line_offset = atomic_load_explicit(&segment->line_offset, memory_order_acquire);
+
+        if (line_offset != SIZE_MAX && segment->line <= line) {
+            offset = line_offset;
+            count = line - segment->line;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&segment_log.lock);
+
+    if (offset == SIZE_MAX) {
+        return atomic_load_explicit(&segment_log.start, memory_order_acquire);
+    }
+
+    char block[REPLAY_BUFFER_SIZE];
+    int fd = -1;
+    size_t index = 0;
+
+    while (count > 0 && offset < end) {
+
+        size_t n = end - offset;
+        if (n > sizeof(block)) {
+            n = sizeof(block);
+        }
+        if (n > segment_room(offset)) {
+            n = segment_room(offset);
+        }
+
+        if (segment_open_read(&fd, &index, offset) < 0) {
+            offset = atomic_load_explicit(&segment_log.start, memory_order_acquire);
+            break;
+        }
+
+        ssize_t nread = pread(fd, block, n, segment_offset(offset));
+        if (nread <= 0) {
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            offset = end;
+            break;
+        }
+
+        struct newline_scan scan;
+        size_t next = 0;
+
+        newline_scan_init(&scan, block, nread);
+        while (count > 0 && (next = newline_scan_next(&scan)) > 0) {
+            count--;
+        }
+
+        offset += count == 0 ? next : (size_t)nread;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return offset;
+}
+
+/**
+ * Read the history from from to end back from its segments, indexing the lines
+ * past index_from and, when replaying from memory, loading all of it into the
+ * memlog.  Parts of a segment that were never written read as zeros.
+ */
+void history_scan(size_t from, size_t end, size_t index_from) {
+
+    char block[REPLAY_BUFFER_SIZE];
+    int fd = -1;
+    size_t index = 0;
+
+    while (from < end) {
+
+        size_t n = end - from;
+        if (n > sizeof(block)) {
+            n = sizeof(block);
+        }
+        if (n > segment_room(from)) {
+            n = segment_room(from);
+        }
+
+        if (segment_open_read(&fd, &index, from) < 0) {
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+
+        ssize_t nread = pread(fd, block, n, segment_offset(from));
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        if (nread == 0) {
+            memset(block, 0, n);
+            nread = n;
+        }
+
+        if (from + nread > index_from) {
+            size_t skip = from < index_from ? index_from - from : 0;
+            if (line_index_append(&block[skip], nread - skip, from + skip) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (replay_source == REPLAY_MEMORY && memlog_write(block, nread, from) < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        from += nread;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    atomic_store(&line_index.published, line_index.lines);
+}
+
+/**
+ * Rebuild the segments from the manifest.  The tail is the end of the newest
+ * segment file, and only the history from the newest line recorded in the
+ * manifest is scanned, to count the lines since and record the line starts the
+ * manifest missed.  The segment size of an existing log is kept.
+ */
+static void segment_log_load(void) {
+
+    char path[PATH_MAX];
+    char entry[128];
+    size_t size;
+    size_t first = SIZE_MAX;
+    size_t next = 0;
+    size_t tail;
+    size_t scan_from;
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s%s", filename, MANIFEST_SUFFIX);
+
+    FILE *file = fopen(path, "re");
+    if (!file) {
+        if (errno == ENOENT) {
+            return;
+        }
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!fgets(entry, sizeof(entry), file) || sscanf(entry, "segments %zu", &size) != 1 || size == 0) {
+        fprintf(stderr, "%s: invalid manifest\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (size != segment_log.size) {
+        syslog(LOG_INFO, "Keeping segment size %zu of the existing log", size);
+        segment_log.size = size;
+    }
+
+    while (fgets(entry, sizeof(entry), file)) {
+
+        size_t index, line, line_offset;
+        int fields = sscanf(entry, "%zu %zu %zu", &index, &line, &line_offset);
+
+        if (fields < 1 || (first != SIZE_MAX && index != next)) {
+            fprintf(stderr, "%s: invalid manifest\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        if (first == SIZE_MAX) {
+            first = index;
+        }
+
+        if (fields == 3) {
+            segment_slot(index)->line = line;
+            atomic_store(&segment_slot(index)->line_offset, line_offset);
+        }
+
+        next = index + 1;
+    }
+
+    fclose(file);
+
+    if (first == SIZE_MAX) {
+        return;
+    }
+
+    segment_log.first = first;
+    segment_log.synced = first;
+    atomic_store(&segment_log.next, next);
+
+    // A manifest always keeps a line start unless the log starts at segment 0
+
+    if ((scan_from = segment_first_line(first)) == SIZE_MAX) {
+        fprintf(stderr, "%s: no line start recorded\n", path);
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&segment_log.start, scan_from);
+
+    for (size_t index = next; index-- > first; ) {
+        size_t line_offset = atomic_load(&segment_slot(index)->line_offset);
+        if (line_offset != SIZE_MAX) {
+            scan_from = line_offset;
+            line_index.lines = segment_slot(index)->line;
+            break;
+        }
+    }
+
+    segment_path(path, next - 1);
+    tail = (next - 1) * segment_log.size;
+    if (stat(path, &st) == 0) {
+        tail += st.st_size;
+    }
+
+    history_scan(replay_source == REPLAY_MEMORY ? first * segment_log.size : scan_from, tail, scan_from);
+
+    atomic_init(&append_log.tail, tail);
+    atomic_init(&append_log.published, tail);
+
+    syslog(LOG_DEBUG, "Loaded segments %zu to %zu, %zu bytes scanned", first, next - 1, tail - scan_from);
+}
+
+/**
+ * Rebuild the history left by a previous run, so replays start from it.  An
+ * unsegmented data file is scanned in full to index its lines, unless a running
+ * server handed its index over.
+ */
+void history_load(void) {
+
+    struct stat st;
+
+    for (size_t i = 0; i < SEGMENT_MAX; i++) {
+        atomic_init(&segment_log.segments[i].fd, -1);
+        atomic_init(&segment_log.segments[i].line_offset, SIZE_MAX);
+    }
+
+    if (handoff.previous_fd >= 0 && handoff_load()) {
+        return;
+    }
+
+    if (segment_log.enabled) {
+        segment_log_load();
+        return;
+    }
+
+    if (stat(filename, &st) < 0) {
+        if (errno == ENOENT) {
+            return;
+        }
+        perror("stat");
+        exit(EXIT_FAILURE);
+    }
+
+    history_scan(0, st.st_size, 0);
+}
+
+/**
+ * Create the unsegmented data file and start the tail at its current size.  A
+ * segmented log creates its segments as they are written.
+ */
+void append_log_open(void) {
+
+    struct stat st;
+
+    if (segment_log.enabled) {
+        return;
+    }
+
+    // No O_APPEND, pwrite would ignore the reserved offset
+
+    if (segment_create() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (fstat(atomic_load(&segment_slot(0)->fd), &st) < 0) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_init(&append_log.tail, st.st_size);
+    atomic_init(&append_log.published, st.st_size);
+}
+
+/**
+ * Sync the segments written since the last sync, all but the newest of which
+ * are complete.
+ */
+void history_sync(void) {
+
+    mutex_lock(&segment_log.lock);
+
+    size_t next = atomic_load(&segment_log.next);
+    size_t index = segment_log.synced > segment_log.first ? segment_log.synced : segment_log.first;
+
+    for (; index < next; index++) {
+        int fd = atomic_load(&segment_slot(index)->fd);
+        if (fd >= 0 && fdatasync(fd) < 0) {
+            perror("fdatasync");
+        }
+    }
+
+    if (next > 0) {
+        segment_log.synced = next - 1;
+    }
+
+    pthread_mutex_unlock(&segment_log.lock);
+}
+
+/**
+ * Record the newest line starts in the manifest of a segmented log, which is kept
+ * for the next run, and close the segments.  An unsegmented data file is removed.
+ * A history handed over is left to the new server.
+ */
+void history_close(void) {
+
+    mutex_lock(&segment_log.lock);
+
+    if (segment_log.enabled && handoff.next_fd < 0) {
+        manifest_write();
+    }
+
+    for (size_t index = segment_log.first; index < atomic_load(&segment_log.next); index++) {
+        int fd = atomic_exchange(&segment_slot(index)->fd, -1);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    pthread_mutex_unlock(&segment_log.lock);
+
+    if (!segment_log.enabled && handoff.next_fd < 0) {
+        remove(filename);
+    }
+}
+
+static int write_all_at(int fd, const char *data, size_t len, size_t offset) {
+
+    while (len > 0) {
+        ssize_t nwrite = pwrite(fd, data, len, offset);
+        if (nwrite < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return -1;
+        }
+        data += nwrite;
+        len -= nwrite;
+        offset += nwrite;
+    }
+
+    return 0;
+}
+
+/**
+ * Whether the history is published up to offset.  Otherwise, with a notify_fd
+ * the caller is woken through it once published advances, without one it
+ * waits until then.
+ * @return 1 once published, 0 if the caller is to be notified, -1 if the log
+ * failed before offset, as published never gets past the failed range
+ */
+int history_published(size_t offset, int notify_fd) {
+
+    if (atomic_load_explicit(&append_log.published, memory_order_acquire) >= offset) {
+        return 1;
+    }
+
+    mutex_lock(&append_log.lock);
+
+    while (atomic_load_explicit(&append_log.published, memory_order_relaxed) < offset) {
+
+        if (append_log.failed) {
+            pthread_mutex_unlock(&append_log.lock);
+            return -1;
+        }
+
+        if (notify_fd >= 0) {
+
+            int i;
+
+            for (i = 0; i < append_log.nnotify && append_log.notify[i] != notify_fd; i++);
+            if (i == append_log.nnotify && i < COMMIT_MAX_NOTIFY) {
+                append_log.notify[append_log.nnotify++] = notify_fd;
+            }
+
+            pthread_mutex_unlock(&append_log.lock);
+            return 0;
+        }
+
+        pthread_cond_wait(&append_log.published_cond, &append_log.lock);
+    }
+
+    pthread_mutex_unlock(&append_log.lock);
+
+    return 1;
+}
+
+/**
+ * Wait for the history to be published up to offset.
+ * @return 0 once it is, -1 if the log failed before
+ */
+static int history_wait(size_t offset) {
+
+    return history_published(offset, -1) < 0 ? -1 : 0;
+}
+
+/**
+ * Mark the log failed at the range at offset, which could not be written.  The
+ * log is frozen so no later append succeeds, the ranges completed after the
+ * failed one are dropped, and every waiter is woken.  Called with the append log
+ * lock held.
+ */
+static void history_fail(size_t offset) {
+
+    struct append_range *range;
+
+    if (append_log.failed) {
+        return;
+    }
+
+    append_log.failed = true;
+    atomic_fetch_or(&append_log.tail, HISTORY_FROZEN);
+
+    syslog(LOG_ERR, "Failed to write the history at %zu, refusing appends", offset);
+
+    while ((range = TAILQ_FIRST(&append_log.completed))) {
+        TAILQ_REMOVE(&append_log.completed, range, entries);
+        free(range->lines);
+        free(range);
+    }
+
+    pthread_cond_broadcast(&append_log.published_cond);
+}
+
+/**
+ * Publish every completed range contiguous with published, indexing their lines.
+ * A failed range fails the log instead, published stays before it.  Called with
+ * the append log lock held.
+ */
+static void history_publish(void) {
+
+    size_t published = atomic_load_explicit(&append_log.published, memory_order_relaxed);
+    size_t start = published;
+    struct append_range *range;
+
+    while ((range = TAILQ_FIRST(&append_log.completed)) && range->offset == published) {
+
+        if (range->failed) {
+            history_fail(range->offset);
+            break;
+        }
+
+        TAILQ_REMOVE(&append_log.completed, range, entries);
+
+        for (size_t i = 0; i < range->nlines; i++) {
+            if (line_index_add(range->lines[i]) < 0) {
+                break;
+            }
+        }
+
+        published = range->end;
+        free(range->lines);
+        free(range);
+    }
+
+    if (published == start) {
+        return;
+    }
+
+    atomic_store_explicit(&line_index.published, line_index.lines, memory_order_release);
+    atomic_store_explicit(&append_log.published, published, memory_order_release);
+    pthread_cond_broadcast(&append_log.published_cond);
+}
+
+/**
+ * Wake the event loops waiting for published to advance, once the append log lock
+ * has been released.
+ */
+static void history_notify(int *notify, int nnotify) {
+
+    uint64_t one = 1;
+
+    for (int i = 0; i < nnotify; i++) {
+        if (write(notify[i], &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
+}
+
+/**
+ * Add the newlines of data, which starts at offset in the history, to range.
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static int append_range_scan(struct append_range *range, const char *data, size_t len, size_t offset) {
+
+    struct newline_scan scan;
+    size_t next;
+
+    newline_scan_init(&scan, data, len);
+
+    while ((next = newline_scan_next(&scan)) > 0) {
+
+        if (range->nlines == range->size) {
+
+            size_t size = range->size ? range->size * 2 : APPEND_RANGE_LINES;
+            size_t *lines = realloc(range->lines, size * sizeof(size_t));
+            if (!lines) {
+                perror("realloc");
+                return -1;
+            }
+
+            range->lines = lines;
+            range->size = size;
+        }
+
+        range->lines[range->nlines++] = offset + next;
+    }
+
+    return 0;
+}
+
+static struct append_range *append_range_create(size_t offset, size_t end) {
+
+    struct append_range *range = calloc(1, sizeof(struct append_range));
+    if (!range) {
+        perror("calloc");
+        return NULL;
+    }
+
+    range->offset = offset;
+    range->end = end;
+
+    return range;
+}
+
+/**
+ * Hand a range its writer is done with to the append log, which publishes it once
+ * the ranges before it are.  Without a record of the range its lines are unknown,
+ * so its writer waits for the ranges before it and fails the log there.  A range
+ * completed after the log failed is dropped.
+ */
+static void history_complete(struct append_range *range, size_t offset, size_t end) {
+
+    int notify[COMMIT_MAX_NOTIFY];
+    int nnotify;
+
+    if (!range) {
+
+        history_wait(offset);
+
+        mutex_lock(&append_log.lock);
+        history_fail(offset);
+
+    } else {
+
+        struct append_range *prev;
+
+        mutex_lock(&append_log.lock);
+
+        if (append_log.failed) {
+            pthread_mutex_unlock(&append_log.lock);
+            free(range->lines);
+            free(range);
+            return;
+        }
+
+        // Ranges mostly complete in order, so search for the place from the end
+
+        TAILQ_FOREACH_REVERSE(prev, &append_log.completed, append_ranges, entries) {
+            if (prev->offset < range->offset) {
+                break;
+            }
+        }
+
+        if (prev) {
+            TAILQ_INSERT_AFTER(&append_log.completed, prev, range, entries);
+        } else {
+            TAILQ_INSERT_HEAD(&append_log.completed, range, entries);
+        }
+
+        history_publish();
+    }
+
+    // Event loops register again if published is still short of what they wait for
+
+    nnotify = 0;
+    if (atomic_load_explicit(&append_log.published, memory_order_relaxed) >= end || append_log.failed) {
+        nnotify = append_log.nnotify;
+        memcpy(notify, append_log.notify, nnotify * sizeof(int));
+        append_log.nnotify = 0;
+    }
+
+    pthread_mutex_unlock(&append_log.lock);
+
+    history_notify(notify, nnotify);
+}
+
+/**
+ * Write data at offset of the history, split across the segments it spans.
+ * @return 0 on success, -1 on error
+ */
+static int history_write(const char *data, size_t len, size_t offset) {
+
+    while (len > 0) {
+
+        size_t n = len < segment_room(offset) ? len : segment_room(offset);
+        int fd = segment_fd(offset);
+
+        if (fd < 0 || write_all_at(fd, data, n, segment_offset(offset)) < 0) {
+            return -1;
+        }
+
+        data += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Complete the range at offset holding the iovecs, recording their lines and, when
+ * replaying from memory, copying them to the memlog.  The range is completed
+ * even if writing it failed, rc, so that it fails the log instead of being
+ * published.
+ * @return 0 on success, -1 on error
+ */
+int history_commit(struct iovec *iov, int iovcnt, size_t offset, int rc) {
+
+    size_t end = offset;
+
+    for (int i = 0; i < iovcnt; i++) {
+        end += iov[i].iov_len;
+    }
+
+    struct append_range *range = append_range_create(offset, end);
+    size_t pos = offset;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (rc == 0 && range) {
+            rc = append_range_scan(range, iov[i].iov_base, iov[i].iov_len, pos);
+        }
+        if (rc == 0 && replay_source == REPLAY_MEMORY) {
+            rc = memlog_write(iov[i].iov_base, iov[i].iov_len, pos);
+        }
+        pos += iov[i].iov_len;
+    }
+
+    if (range) {
+        range->failed = rc < 0;
+    } else {
+        rc = -1;
+    }
+
+    history_complete(range, offset, end);
+
+    return rc;
+}
+
+/**
+ * Reserve len bytes at the tail of the history, storing their offset.  When
+ * replaying from memory, an append the memlog has no room for is refused before
+ * its range is reserved, as a reserved range must always be completed.
+ * @return 0 on success, -1 once the history is frozen by history_freeze or if the
+ * memlog is full
+ */
+int history_reserve(size_t len, size_t *offset) {
+
+    size_t tail = atomic_load(&append_log.tail);
+
+    do {
+        if (tail & HISTORY_FROZEN) {
+            return -1;
+        }
+        if (replay_source == REPLAY_MEMORY && !memlog_fits(tail, len)) {
+            fprintf(stderr, "memlog full\n");
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&append_log.tail, &tail, tail + len));
+
+    *offset = tail;
+
+    return 0;
+}
+
+/**
+ * Stop appends to the history, which is handed over, and wait for those already
+ * reserved to be published.
+ * @return the final tail, or where the log failed, as nothing after is replayable
+ */
+size_t history_freeze(void) {
+
+    size_t tail = atomic_fetch_or(&append_log.tail, HISTORY_FROZEN) & ~HISTORY_FROZEN;
+
+    if (history_wait(tail) < 0) {
+        return atomic_load_explicit(&append_log.published, memory_order_acquire);
+    }
+
+    return tail;
+}
+
+/**
+ * Append the iovecs to the history at a reserved offset and commit them, storing
+ * the end of the range in end unless it is NULL.  They are replayed once
+ * published up to there.
+ * @return 0 on success, -1 on error or once the history is frozen
+ */
+int history_append(struct iovec *iov, int iovcnt, size_t *end) {
+
+    size_t len = 0;
+    size_t offset;
+    int rc = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    if (history_reserve(len, &offset) < 0) {
+        return -1;
+    }
+
+    size_t written = offset;
+
+    for (int i = 0; i < iovcnt && rc == 0; i++) {
+        rc = history_write(iov[i].iov_base, iov[i].iov_len, written);
+        written += iov[i].iov_len;
+    }
+
+    if (end) {
+        *end = offset + len;
+    }
+
+    return history_commit(iov, iovcnt, offset, rc);
+}
+
+/**
+ * Copy len bytes of fd, holding a single packet, to the history range reserved at
+ * offset.  The copy is done by copy_file_range where the file systems support it.
+ * @return 0 on success, -1 on error
+ */
+int history_copy_file(int fd, size_t len, size_t offset) {
+
+    char block[REPLAY_BUFFER_SIZE];
+    loff_t in = 0;
+    bool copy_range = true;
+    int rc = 0;
+
+    while (rc == 0 && (size_t)in < len) {
+
+        size_t out = offset + in;
+        size_t count = len - in < segment_room(out) ? len - in : segment_room(out);
+        int out_fd = segment_fd(out);
+        ssize_t n;
+
+        if (out_fd < 0) {
+            rc = -1;
+            break;
+        }
+
+        if (copy_range) {
+            loff_t out_offset = segment_offset(out);
+            n = copy_file_range(fd, &in, out_fd, &out_offset, count, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                copy_range = false;
+                continue;
+            }
+        } else {
+            n = pread(fd, block, count < sizeof(block) ? count : sizeof(block), in);
+            if (n > 0 && write_all_at(out_fd, block, n, segment_offset(out)) < 0) {
+                n = -1;
+            }
+            if (n > 0) {
+                in += n;
+            }
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("copy_file_range");
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Commit the packet copied from fd at offset, like history_commit.  Nothing waits
+ * for the ranges before it, so other writers go on while a large packet is
+ * copied, only the ranges after it are published once it is.
+ * @return 0 on success, -1 on error
+ */
+int history_commit_file(int fd, size_t len, size_t offset, int rc) {
+
+    char block[REPLAY_BUFFER_SIZE];
+    loff_t in;
+
+    struct append_range *range = append_range_create(offset, offset + len);
+
+    // The newline ending the packet is its only one
+
+    if (rc == 0 && range) {
+        rc = append_range_scan(range, "\n", 1, offset + len - 1);
+    }
+
+    for (in = 0; rc == 0 && replay_source == REPLAY_MEMORY && (size_t)in < len; ) {
+        ssize_t n = pread(fd, block, len - in < sizeof(block) ? len - in : sizeof(block), in);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            rc = -1;
+            break;
+        }
+        rc = memlog_write(block, n, offset + in);
+        in += n;
+    }
+
+    if (range) {
+        range->failed = rc < 0;
+    } else {
+        rc = -1;
+    }
+
+    history_complete(range, offset, offset + len);
+
+    return rc;
+}
+
+/**
+ * Append len bytes of fd, holding a single packet, to the history, storing the end
+ * of its range in end like history_append.
+ * @return 0 on success, -1 on error or once the history is frozen
+ */
+int history_append_file(int fd, size_t len, size_t *end) {
+
+    size_t offset;
+
+    if (history_reserve(len, &offset) < 0) {
+        return -1;
+    }
+
+    *end = offset + len;
+
+    return history_commit_file(fd, len, offset, history_copy_file(fd, len, offset));
+}
+
+/**
+ * Queue a line for the commit thread and record its sequence number in the
+ * connection, which must not be replayed to before the line is committed.
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int commit_submit(struct connection *conn, const char *line, size_t len) {
+
+    struct commit_request *request = malloc(sizeof(struct commit_request) + len);
+    if (!request) {
+        perror("malloc");
+        return -1;
+    }
+
+    request->notify_fd = conn->notify_fd;
+    request->len = len;
+    memcpy(request->data, line, len);
+
+    mutex_lock(&commit_log.lock);
+
+    STAILQ_INSERT_TAIL(&commit_log.pending, request, next);
+    conn->commit_seq = ++commit_log.submitted;
+    pthread_cond_signal(&commit_log.submitted_cond);
+
+    pthread_mutex_unlock(&commit_log.lock);
+
+    return 0;
+}
+
+/**
+ * Append a batch of requests to the data file, reserving one range for every
+ * IOV_MAX lines, and wait for it to be published.
+ * @return 0 on success, -1 on error
+ */
+static int commit_write(struct commit_request *request) {
+
+    struct iovec iov[IOV_MAX];
+    size_t end = 0;
+    int rc = 0;
+
+    while (request && rc == 0) {
+
+        int iovcnt = 0;
+
+        for (; request && iovcnt < IOV_MAX; request = STAILQ_NEXT(request, next)) {
+            iov[iovcnt].iov_base = request->data;
+            iov[iovcnt].iov_len = request->len;
+            iovcnt++;
+        }
+
+        rc = history_append(iov, iovcnt, &end);
+    }
+
+    // Replies to the batch follow its commit, so it must be published first
+
+    if (history_wait(end) < 0) {
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/**
+ * Wake every event loop with a connection in the batch, once per loop.
+ */
+static void commit_notify(struct commit_request *request) {
+
+    int notified[COMMIT_MAX_NOTIFY];
+    int nnotified = 0;
+    uint64_t one = 1;
+
+    for (; request; request = STAILQ_NEXT(request, next)) {
+
+        int i;
+
+        if (request->notify_fd < 0) {
+            continue;
+        }
+
+        for (i = 0; i < nnotified && notified[i] != request->notify_fd; i++);
+        if (i < nnotified) {
+            continue;
+        }
+
+        if (nnotified < COMMIT_MAX_NOTIFY) {
+            notified[nnotified++] = request->notify_fd;
+        }
+
+        if (write(request->notify_fd, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
+}
+
+static void commit_sync(struct timespec *last_sync) {
+
+    history_sync();
+
+    clock_gettime(CLOCK_REALTIME, last_sync);
+}
+
+/**
+ * Take everything queued as one batch, write it, sync it according to the policy
+ * and only then publish its last sequence number.  With SYNC_INTERVAL, replies
+ * do not wait for the sync, which instead runs at most every sync_interval ms
+ * while there is unsynced data.
+ */
+void *commit_thread(void *arg) {
+
+    struct timespec last_sync;
+    bool dirty = false;
+
+    clock_gettime(CLOCK_REALTIME, &last_sync);
+
+    mutex_lock(&commit_log.lock);
+
+    while (true) {
+
+        bool timed_out = false;
+
+        while (STAILQ_EMPTY(&commit_log.pending) && !commit_log.stopping && !timed_out) {
+
+            if (dirty && commit_log.sync_policy == SYNC_INTERVAL) {
+
+                struct timespec deadline = last_sync;
+                deadline.tv_sec += commit_log.sync_interval / 1000;
+                deadline.tv_nsec += (commit_log.sync_interval % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+
+                timed_out = pthread_cond_timedwait(&commit_log.submitted_cond, &commit_log.lock,
+                        &deadline) == ETIMEDOUT;
+            } else {
+                pthread_cond_wait(&commit_log.submitted_cond, &commit_log.lock);
+            }
+        }
+
+        if (STAILQ_EMPTY(&commit_log.pending) && commit_log.stopping) {
+            break;
+        }
+
+        struct commit_request *batch = STAILQ_FIRST(&commit_log.pending);
+        unsigned long last = commit_log.submitted;
+        STAILQ_INIT(&commit_log.pending);
+
+        pthread_mutex_unlock(&commit_log.lock);
+
+        int rc = 0;
+
+        if (batch) {
+            rc = commit_write(batch);
+            dirty = true;
+        }
+
+        if (dirty && commit_log.sync_policy == SYNC_BATCH) {
+            commit_sync(&last_sync);
+            dirty = false;
+        } else if (dirty && commit_log.sync_policy == SYNC_INTERVAL) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if ((now.tv_sec - last_sync.tv_sec) * 1000 + (now.tv_nsec - last_sync.tv_nsec) / 1000000
+                    >= commit_log.sync_interval) {
+                commit_sync(&last_sync);
+                dirty = false;
+            }
+        }
+
+        mutex_lock(&commit_log.lock);
+
+        if (rc < 0) {
+            commit_log.failed = true;
+        }
+        commit_log.committed = last;
+        pthread_cond_broadcast(&commit_log.committed_cond);
+
+        pthread_mutex_unlock(&commit_log.lock);
+
+        commit_notify(batch);
+
+        while (batch) {
+            struct commit_request *next = STAILQ_NEXT(batch, next);
+            free(batch);
+            batch = next;
+        }
+
+        mutex_lock(&commit_log.lock);
+    }
+
+    pthread_mutex_unlock(&commit_log.lock);
+
+    if (dirty) {
+        commit_sync(&last_sync);
+    }
+
+    return arg;
+}
+
+void commit_start(void) {
+
+    sigset_t oldmask;
+
+    block_signals(&oldmask);
+
+    if (pthread_create(&commit_log.thread, NULL, commit_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+/**
+ * Stop the commit thread once every connection is closed, after it has written
+ * and synced whatever is still queued.  Does nothing if already stopped.
+ */
+void commit_stop(void) {
+
+    if (commit_log.stopping) {
+        return;
+    }
+
+    mutex_lock(&commit_log.lock);
+    commit_log.stopping = true;
+    pthread_cond_signal(&commit_log.submitted_cond);
+    pthread_mutex_unlock(&commit_log.lock);
+
+    if (pthread_join(commit_log.thread, NULL) != 0) {
+        perror("pthread_join");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Append a timestamp line to the history.
+ */
+void history_timestamp(void) {
+
+    char outstr[200];
+    time_t t;
+    struct tm tm;
+
+    t = time(NULL);
+    if (localtime_r(&t, &tm) == NULL) {
+        perror("localtime_r");
+        exit(EXIT_FAILURE);
+    }
+
+    if (strftime(outstr, sizeof(outstr), "timestamp: %F %T\n", &tm) == 0) {
+        perror("strftime");
+        exit(EXIT_FAILURE);
+    }
+
+    struct iovec iov = {
+        .iov_base = outstr,
+        .iov_len = strlen(outstr),
+    };
+
+    history_append(&iov, 1, NULL);
+}
@@ -0,0 +1,192 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#define MEMLOG_CHUNK_SIZE (1024 * 1024)
+#define MEMLOG_MAX_CHUNKS 65536
+#define LINE_INDEX_BLOCK_SIZE 65536
+#define LINE_INDEX_MAX_BLOCKS 65536
+#define SEGMENT_MAX 65536
+#define COMMIT_MAX_NOTIFY 64
+
+struct connection;
+
+#ifndef USE_AESD_CHAR_DEVICE
+
+/**
+ * Tail of the history.  A writer reserves its byte range by advancing tail and
+ * writes it with pwrite, so concurrent writers never share a lock.  Finished
+ * ranges go on completed, sorted by offset, and whichever writer finishes the
+ * range at published moves it past every contiguous range there, indexing their
+ * lines in order, so no writer waits for another.  Everything below published
+ * has been written, so replays stop there and never see a partially written
+ * line.  The lock only covers completed and the line index updates.  Whenever
+ * published advances, threads waiting for it are woken through published_cond
+ * and event loops through the notify fds they left in notify.  Setting the
+ * HISTORY_FROZEN bit of tail makes every later reservation fail.  A range that
+ * could not be written marks the log failed: published stops before it, so it is
+ * never replayed, and the log is frozen.
+ */
+struct append_log {
+    atomic_size_t tail;
+    atomic_size_t published;
+    pthread_mutex_t lock;
+    pthread_cond_t published_cond;
+    TAILQ_HEAD(append_ranges, append_range) completed;
+    int notify[COMMIT_MAX_NOTIFY];
+    int nnotify;
+    bool failed;
+};
+
+/**
+ * A segment of the history, with its write fd once opened and the first line
+ * starting after a newline held by the segment, or line_offset SIZE_MAX if the
+ * segment holds no newline yet.  Segment 0 also holds the start of line 0.
+ */
+struct segment {
+    atomic_int fd;
+    size_t line;
+    atomic_size_t line_offset;
+};
+
+/**
+ * The history split in files of size bytes, segment i holding offsets from i * size
+ * and named after filename and i.  Segments first to next - 1 are present and
+ * listed in a manifest with their first line, so that a restart only scans the
+ * history past the newest line recorded there.  Whole segments are dropped
+ * from the front to stay within retain_bytes and retain_age, replays then
+ * start at start, the first line left.  Without -S, filename is the only segment.
+ * Writers look up segment fds without the lock, it is taken to create, drop and
+ * sync segments and to rewrite the manifest.
+ */
+struct segment_log {
+    pthread_mutex_t lock;
+    bool enabled;
+    size_t size;
+    size_t retain_bytes;
+    time_t retain_age;
+    size_t first;
+    atomic_size_t next;
+    atomic_size_t start;
+    size_t synced;
+    struct segment segments[SEGMENT_MAX];
+};
+
+/**
+ * Append-only copy of the data file shared by every connection for replay.  Data is
+ * stored at its history offset in fixed size chunks that are never moved or
+ * freed while the server runs, so bytes below the published length can be sent
+ * while appends continue.  Writers fill their own ranges, allocating a chunk
+ * with a compare and swap when they are the first to reach it.
+ */
+struct memlog {
+    _Atomic(char*) chunks[MEMLOG_MAX_CHUNKS];
+};
+
+/**
+ * Offset just past each newline in the data file, for replays starting at a line.
+ * Entries are filled in fixed size blocks under the append log lock as ranges
+ * are published, then made visible by advancing published, so readers need no
+ * lock.
+ */
+struct line_index {
+    size_t *blocks[LINE_INDEX_MAX_BLOCKS];
+    size_t lines;
+    atomic_size_t published;
+};
+
+enum sync_policy {
+    SYNC_NONE,
+    SYNC_BATCH,
+    SYNC_INTERVAL,
+};
+
+/**
+ * Group commit of received lines.  Connections queue their lines on pending and the
+ * commit thread appends everything queued with one writev per batch.  Sequence
+ * numbers are handed out in queue order, so a line is in the data file once
+ * committed has reached its number.  Threads wait on committed_cond, event loops
+ * are woken through the notify_fd of their requests.
+ */
+struct commit_log {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted_cond;
+    pthread_cond_t committed_cond;
+    STAILQ_HEAD(, commit_request) pending;
+    unsigned long submitted;
+    unsigned long committed;
+    bool enabled;
+    bool stopping;
+    bool failed;
+    enum sync_policy sync_policy;
+    int sync_interval;
+};
+
+extern struct append_log append_log;
+extern struct segment_log segment_log;
+extern struct memlog memlog;
+extern struct line_index line_index;
+extern struct commit_log commit_log;
+
+// Segments and line index
+
+static inline struct segment *segment_slot(size_t index) {
+
+    return &segment_log.segments[index % SEGMENT_MAX];
+}
+
+/**
+ * Offset of a history offset within its segment file.
+ */
+static inline size_t segment_offset(size_t offset) {
+
+    return offset % segment_log.size;
+}
+
+/**
+ * Bytes from offset to the end of its segment.
+ */
+static inline size_t segment_room(size_t offset) {
+
+    return segment_log.size - segment_offset(offset);
+}
+
+const char *history_map(size_t offset, size_t *len);
+int segment_open_read(int *fd, size_t *index, size_t offset);
+void manifest_write(void);
+int segment_fd(size_t offset);
+void segment_retain(void);
+size_t line_index_offset(size_t line);
+void history_scan(size_t from, size_t end, size_t index_from);
+
+// Append log
+
+void history_load(void);
+void append_log_open(void);
+void history_sync(void);
+void history_close(void);
+int history_published(size_t offset, int notify_fd);
+int history_commit(struct iovec *iov, int iovcnt, size_t offset, int rc);
+int history_reserve(size_t len, size_t *offset);
+size_t history_freeze(void);
+int history_append(struct iovec *iov, int iovcnt, size_t *end);
+int history_copy_file(int fd, size_t len, size_t offset);
+int history_commit_file(int fd, size_t len, size_t offset, int rc);
+int history_append_file(int fd, size_t len, size_t *end);
+void history_timestamp(void);
+
+// Group commit, with -g
+
+int commit_submit(struct connection *conn, const char *line, size_t len);
+void commit_start(void);
+void commit_stop(void);
+#endif
+
+#endif /* HISTORY_H */
@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "aesdsocket.h"
+#include "metrics.h"
+#include "handoff.h"
+
+#define METRICS_TIMEOUT 1
+
+struct metrics_registry metrics = {
+    .server_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct metrics *thread_metrics;
+
+/**
+ * Monotonic time in nanoseconds, or 0 when metrics are disabled.
+ */
+uint64_t metrics_now(void) {
+
+    struct timespec now;
+
+    if (!metrics.enabled) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Destructor of the thread's metrics block, run as the thread exits.
+ */
+static void metrics_retire(void *arg) {
+
+    struct metrics *block = arg;
+
+    thread_metrics = NULL;
+
+    pthread_mutex_lock(&metrics.lock);
+
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        metrics.retired.counters[i] += block->counters[i];
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+        for (int j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            metrics.retired.histograms[i].buckets[j] += block->histograms[i].buckets[j];
+        }
+        metrics.retired.histograms[i].sum += block->histograms[i].sum;
+    }
+
+    LIST_REMOVE(block, entries);
+    memset(block, 0, sizeof(*block));
+    LIST_INSERT_HEAD(&metrics.free, block, entries);
+
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+/**
+ * The metrics block of the calling thread, taken from the free list or allocated
+ * on first use.
+ * @return the block, or NULL if metrics are disabled or memory ran out
+ */
+static struct metrics *metrics_thread(void) {
+
+    if (thread_metrics || !metrics.enabled) {
+        return thread_metrics;
+    }
+
+    pthread_mutex_lock(&metrics.lock);
+
+    struct metrics *block = LIST_FIRST(&metrics.free);
+
+    if (block) {
+        LIST_REMOVE(block, entries);
+    } else if (!(block = calloc(1, sizeof(struct metrics)))) {
+        perror("calloc");
+    }
+
+    if (block) {
+        LIST_INSERT_HEAD(&metrics.threads, block, entries);
+    }
+
+    pthread_mutex_unlock(&metrics.lock);
+
+    if (block) {
+        pthread_setspecific(metrics.key, block);
+    }
+
+    return thread_metrics = block;
+}
+
+static void metrics_add(_Atomic uint64_t *value, uint64_t n) {
+
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+void metrics_count(enum metrics_counter counter, uint64_t n) {
+
+    struct metrics *block = metrics_thread();
+
+    if (block) {
+        metrics_add(&block->counters[counter], n);
+    }
+}
+
+static unsigned int histogram_bucket(uint64_t value) {
+
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    unsigned int sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/**
+ * Largest value counted in a bucket.
+ */
+static uint64_t histogram_bucket_limit(unsigned int bucket) {
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void metrics_observe(enum metrics_histogram histogram, uint64_t value) {
+
+    struct metrics *block = metrics_thread();
+
+    if (block) {
+        metrics_add(&block->histograms[histogram].buckets[histogram_bucket(value)], 1);
+        metrics_add(&block->histograms[histogram].sum, value);
+    }
+}
+
+/**
+ * Add up the metrics of every thread, past and present, into total.
+ */
+static void metrics_collect(struct metrics *total) {
+
+    struct metrics *block;
+
+    memset(total, 0, sizeof(*total));
+
+    pthread_mutex_lock(&metrics.lock);
+
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        total->counters[i] = metrics.retired.counters[i];
+        LIST_FOREACH(block, &metrics.threads, entries) {
+            total->counters[i] += atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+        }
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+        struct histogram *h = &total->histograms[i];
+        for (int j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            h->buckets[j] = metrics.retired.histograms[i].buckets[j];
+            LIST_FOREACH(block, &metrics.threads, entries) {
+                h->buckets[j] += atomic_load_explicit(&block->histograms[i].buckets[j], memory_order_relaxed);
+            }
+        }
+        h->sum = metrics.retired.histograms[i].sum;
+        LIST_FOREACH(block, &metrics.threads, entries) {
+            h->sum += atomic_load_explicit(&block->histograms[i].sum, memory_order_relaxed);
+        }
+    }
+
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+/**
+ * Write a histogram in the Prometheus text format, with values multiplied by
+ * scale.  Only the buckets from the lowest to the highest ever hit are listed,
+ * the counts being cumulative, the set of series only grows.
+ */
+static void metrics_write_histogram(FILE *out, const char *name, const char *help,
+        struct histogram *h, double scale) {
+
+    int first = 0;
+    int last = HISTOGRAM_BUCKETS - 1;
+    uint64_t count = 0;
+
+    while (last >= 0 && h->buckets[last] == 0) {
+        last--;
+    }
+
+    while (first < last && h->buckets[first] == 0) {
+        first++;
+    }
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    for (int i = first; i <= last; i++) {
+        count += h->buckets[i];
+        fprintf(out, "%s_bucket{le=\"%.9g\"} %" PRIu64 "\n", name,
+                histogram_bucket_limit(i) * scale, count);
+    }
+
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, count);
+    fprintf(out, "%s_sum %.9g\n%s_count %" PRIu64 "\n", name, h->sum * scale, name, count);
+}
+
+static void metrics_write(FILE *out) {
+
+    struct metrics *total = malloc(sizeof(struct metrics));
+
+    if (!total) {
+        perror("malloc");
+        return;
+    }
+
+    metrics_collect(total);
+
+    fprintf(out, "# HELP aesdsocket_connections_accepted_total Connections accepted.\n"
+            "# TYPE aesdsocket_connections_accepted_total counter\n"
+            "aesdsocket_connections_accepted_total %" PRIu64 "\n",
+            total->counters[METRIC_ACCEPTED]);
+    fprintf(out, "# HELP aesdsocket_connections_active Connections open.\n"
+            "# TYPE aesdsocket_connections_active gauge\n"
+            "aesdsocket_connections_active %" PRIu64 "\n",
+            total->counters[METRIC_ACCEPTED] - total->counters[METRIC_CLOSED]);
+    fprintf(out, "# HELP aesdsocket_received_bytes_total Bytes received from clients.\n"
+            "# TYPE aesdsocket_received_bytes_total counter\n"
+            "aesdsocket_received_bytes_total %" PRIu64 "\n",
+            total->counters[METRIC_BYTES_IN]);
+    fprintf(out, "# HELP aesdsocket_sent_bytes_total Bytes replayed to clients.\n"
+            "# TYPE aesdsocket_sent_bytes_total counter\n"
+            "aesdsocket_sent_bytes_total %" PRIu64 "\n",
+            total->counters[METRIC_BYTES_OUT]);
+
+    metrics_write_histogram(out, "aesdsocket_first_byte_seconds",
+            "Time from accepting a connection to its first received byte.",
+            &total->histograms[METRIC_FIRST_BYTE], 1e-9);
+    metrics_write_histogram(out, "aesdsocket_reply_seconds",
+            "Time from receiving a packet to having sent its reply.",
+            &total->histograms[METRIC_REPLY], 1e-9);
+    metrics_write_histogram(out, "aesdsocket_reply_bytes",
+            "Bytes replayed in answer to a packet.",
+            &total->histograms[METRIC_REPLAY_SIZE], 1);
+    metrics_write_histogram(out, "aesdsocket_lock_wait_seconds",
+            "Time spent waiting for a contended lock.",
+            &total->histograms[METRIC_LOCK_WAIT], 1e-9);
+
+    free(total);
+}
+
+/**
+ * Wait for events on the non-blocking client_fd of a scrape until deadline, or
+ * until serving is cleared.
+ * @return true once client_fd is ready, false on timeout or once serving is cleared
+ */
+static bool metrics_wait(int client_fd, short events, const struct timespec *deadline) {
+
+    struct pollfd fds[2] = {
+        { .fd = client_fd, .events = events },
+        { .fd = close_fd, .events = POLLIN },
+    };
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long timeout = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+    if (timeout <= 0 || poll(fds, 2, timeout) <= 0) {
+        return false;
+    }
+
+    return !(fds[1].revents & POLLIN);
+}
+
+/**
+ * Answer one scrape: read the HTTP request up to its blank line, then send the
+ * metrics.  The client gets METRICS_TIMEOUT seconds for each, so a stuck one
+ * cannot hold up the next scrapes or the exit for long.
+ */
+static void metrics_serve(void) {
+
+    int client_fd = accept4(metrics.server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    char request[4096];
+    size_t request_len = 0;
+    char *response = NULL;
+    size_t response_len = 0;
+    struct timespec deadline;
+
+    if (client_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+            perror("accept4");
+        }
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += METRICS_TIMEOUT;
+
+    while (request_len < sizeof(request) - 1) {
+
+        ssize_t nread = recv(client_fd, &request[request_len], sizeof(request) - 1 - request_len, 0);
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+                metrics_wait(client_fd, POLLIN, &deadline)) {
+            continue;
+        }
+        if (nread <= 0) {
+            goto out;
+        }
+
+        request_len += nread;
+        request[request_len] = '\0';
+
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+
+    FILE *out = open_memstream(&response, &response_len);
+    if (!out) {
+        perror("open_memstream");
+        goto out;
+    }
+
+    metrics_write(out);
+
+    if (fclose(out) != 0) {
+        perror("fclose");
+        goto out;
+    }
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n\r\n", response_len);
+
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = response, .iov_len = response_len },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += METRICS_TIMEOUT;
+
+    while (msg.msg_iovlen > 0) {
+
+        ssize_t nsend = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
+        if (nsend < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+                metrics_wait(client_fd, POLLOUT, &deadline)) {
+            continue;
+        }
+        if (nsend < 0) {
+            break;
+        }
+
+        while (msg.msg_iovlen > 0 && (size_t)nsend >= msg.msg_iov->iov_len) {
+            nsend -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + nsend;
+            msg.msg_iov->iov_len -= nsend;
+        }
+    }
+
+out:
+
+    free(response);
+    close(client_fd);
+}
+
+/**
+ * Answer scrapes until accepting is cleared, by a termination signal or by a new
+ * server taking over, which is handed the metrics socket along with the others.
+ */
+static void *metrics_server_thread(void *arg) {
+
+    struct pollfd fds[2] = {
+        { .fd = metrics.server_fd, .events = POLLIN },
+        { .fd = shutdown_fd, .events = POLLIN },
+    };
+
+    while (atomic_load(&accepting)) {
+
+        if (poll(fds, 2, -1) < 0) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            metrics_serve();
+        }
+    }
+
+    return arg;
+}
+
+void metrics_start(void) {
+
+    sigset_t oldmask;
+
+    block_signals(&oldmask);
+
+    if (pthread_create(&metrics.thread, NULL, metrics_server_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+/**
+ * Wait for the metrics thread, which returns once shutdown_fd wakes it up.
+ */
+void metrics_stop(void) {
+
+    if (pthread_join(metrics.thread, NULL) != 0) {
+        perror("pthread_join");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Listen for scrapes on metrics.address: a port on the loopback interface if it
+ * is a number, otherwise the path of a Unix socket, replacing any left behind.
+ */
+void metrics_open(void) {
+
+    struct sockaddr_storage address = { 0 };
+    socklen_t addrlen;
+    char *end;
+    long port = strtol(metrics.address, &end, 10);
+    int opt = 1;
+
+    if (*metrics.address && !*end) {
+
+        struct sockaddr_in *in = (struct sockaddr_in*)&address;
+
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        in->sin_port = htons(port);
+        addrlen = sizeof(*in);
+
+    } else {
+
+        struct sockaddr_un *un = (struct sockaddr_un*)&address;
+
+        if (strlen(metrics.address) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "metrics socket path too long\n");
+            exit(EXIT_FAILURE);
+        }
+
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, metrics.address);
+        addrlen = sizeof(*un);
+    }
+
+    metrics.family = address.ss_family;
+
+    // A socket handed over by the previous server is kept as it is
+
+    if (metrics.server_fd >= 0) {
+        goto key;
+    }
+
+    if (address.ss_family == AF_UNIX && unlink(metrics.address) < 0 && errno != ENOENT) {
+        perror("unlink");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((metrics.server_fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (address.ss_family == AF_INET &&
+            setsockopt(metrics.server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(metrics.server_fd, (struct sockaddr*)&address, addrlen) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(metrics.server_fd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+key:
+
+    if ((errno = pthread_key_create(&metrics.key, metrics_retire)) != 0) {
+        perror("pthread_key_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void metrics_close(void) {
+
+    close(metrics.server_fd);
+
+    if (metrics.family == AF_UNIX && handoff.next_fd < 0) {
+        unlink(metrics.address);
+    }
+}
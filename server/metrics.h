@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+enum metrics_counter {
+    METRIC_ACCEPTED,
+    METRIC_CLOSED,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_COUNTERS,
+};
+
+enum metrics_histogram {
+    METRIC_FIRST_BYTE,
+    METRIC_REPLY,
+    METRIC_REPLAY_SIZE,
+    METRIC_LOCK_WAIT,
+    METRIC_HISTOGRAMS,
+};
+
+/**
+ * Log-linear histogram in the manner of HdrHistogram: every power of two range is
+ * split into HISTOGRAM_SUB_BUCKETS linear buckets, so a value is known to within
+ * 1 / HISTOGRAM_SUB_BUCKETS of itself over the whole 64 bit range.
+ */
+struct histogram {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t sum;
+};
+
+/**
+ * Counters and histograms of one thread.  Only that thread updates them, with
+ * plain relaxed loads and stores instead of atomic read-modify-writes, while a
+ * scrape may read them at any time.
+ */
+struct metrics {
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    struct histogram histograms[METRIC_HISTOGRAMS];
+    LIST_ENTRY(metrics) entries;
+};
+
+/**
+ * Every thread gets its metrics block on first use.  When the thread exits, the
+ * destructor of key adds the block to retired and recycles it through free, so
+ * short lived connection threads neither lose their counts nor leak blocks.
+ * Scrapes are answered on server_fd by a thread of their own, one at a time.
+ */
+struct metrics_registry {
+    bool enabled;
+    char *address;
+    sa_family_t family;
+    int server_fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_key_t key;
+    LIST_HEAD(, metrics) threads;
+    LIST_HEAD(, metrics) free;
+    struct metrics retired;
+};
+
+extern struct metrics_registry metrics;
+
+uint64_t metrics_now(void);
+void metrics_count(enum metrics_counter counter, uint64_t n);
+void metrics_observe(enum metrics_histogram histogram, uint64_t value);
+void metrics_start(void);
+void metrics_stop(void);
+void metrics_open(void);
+void metrics_close(void);
+
+#endif /* METRICS_H */
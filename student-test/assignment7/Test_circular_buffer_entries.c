@@ -0,0 +1,245 @@
+/**
+ * @file Test_circular_buffer_entries.c
+ * @brief Circular buffer tests for entry arrays of any capacity, set up with
+ * aesd_circular_buffer_init_entries() as the driver does for aesd_max_entries,
+ * for aesd_circular_buffer_remove_entry(), and boundary tests of the binary search
+ * in aesd_circular_buffer_find_entry_offset_for_fpos()
+ */
+
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define TEST_CAPACITY 37
+#define TEST_COMMANDS (3 * TEST_CAPACITY)
+
+static struct aesd_buffer_entry entries[TEST_CAPACITY];
+static char commands[TEST_COMMANDS][16];
+
+/**
+ * Size of command number i, 1 + i % 11 bytes so that sizes differ between neighbours
+ * and include single bytes
+ */
+static size_t command_size(size_t i)
+{
+    return 1 + i % 11;
+}
+
+/**
+ * Add command number i, ending with a newline
+ */
+static void add_command(struct aesd_circular_buffer *buffer, size_t i)
+{
+    struct aesd_buffer_entry entry;
+    size_t size = command_size(i);
+
+    memset(commands[i], 'a' + i % 26, size);
+    commands[i][size - 1] = '\n';
+
+    entry.buffptr = commands[i];
+    entry.size = size;
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * Check that buffer holds commands first up to but not including end, in order from
+ * fpos 0, by looking up the first and last byte of each, and that fpos at their end
+ * finds nothing
+ */
+static void verify_commands(struct aesd_circular_buffer *buffer, size_t first, size_t end)
+{
+    struct aesd_buffer_entry *entry;
+    size_t fpos = 0;
+    size_t offset;
+    char message[64];
+
+    for (size_t i = first; i < end; i++) {
+
+        size_t size = command_size(i);
+
+        snprintf(message, sizeof(message), "first byte of command %zu, fpos %zu", i, fpos);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, message);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(commands[i], entry->buffptr, message);
+        TEST_ASSERT_EQUAL_MESSAGE(0, offset, message);
+
+        snprintf(message, sizeof(message), "last byte of command %zu, fpos %zu", i, fpos + size - 1);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos + size - 1, &offset);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, message);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(commands[i], entry->buffptr, message);
+        TEST_ASSERT_EQUAL_MESSAGE(size - 1, offset, message);
+        TEST_ASSERT_EQUAL_MESSAGE('\n', entry->buffptr[offset], message);
+
+        fpos += size;
+    }
+
+    offset = SIZE_MAX;
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset),
+            "Expected no entry at fpos == end");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos + 1, &offset),
+            "Expected no entry past end");
+    TEST_ASSERT_EQUAL_MESSAGE(SIZE_MAX, offset, "Expected entry_offset_byte_rtn untouched when not found");
+}
+
+void test_circular_buffer_capacity_init(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t index;
+    size_t count = 0;
+    struct aesd_buffer_entry *entry;
+
+    memset(entries, 0xff, sizeof(entries));
+    aesd_circular_buffer_init_entries(&buffer, entries, TEST_CAPACITY);
+
+    TEST_ASSERT_EQUAL_PTR(entries, buffer.entry);
+    TEST_ASSERT_EQUAL(TEST_CAPACITY, buffer.capacity);
+    TEST_ASSERT_FALSE(buffer.full);
+    verify_commands(&buffer, 0, 0);
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &buffer, index) {
+        TEST_ASSERT_NULL(entry->buffptr);
+        count++;
+    }
+    TEST_ASSERT_EQUAL_MESSAGE(TEST_CAPACITY, count, "Expected FOREACH to visit every entry of the array");
+}
+
+void test_circular_buffer_capacity_wraparound(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init_entries(&buffer, entries, TEST_CAPACITY);
+
+    for (size_t i = 0; i < TEST_CAPACITY - 1; i++) {
+        add_command(&buffer, i);
+    }
+    TEST_ASSERT_FALSE_MESSAGE(buffer.full, "Expected the buffer not to be full one entry short of capacity");
+    verify_commands(&buffer, 0, TEST_CAPACITY - 1);
+
+    add_command(&buffer, TEST_CAPACITY - 1);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "Expected the buffer to be full at capacity");
+    verify_commands(&buffer, 0, TEST_CAPACITY);
+
+    // Each further command overwrites the oldest, up to twice around the array
+
+    for (size_t i = TEST_CAPACITY; i < TEST_COMMANDS; i++) {
+        add_command(&buffer, i);
+        TEST_ASSERT_TRUE(buffer.full);
+        verify_commands(&buffer, i - TEST_CAPACITY + 1, i + 1);
+    }
+}
+
+void test_circular_buffer_capacity_remove(void)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t next;
+
+    aesd_circular_buffer_init_entries(&buffer, entries, TEST_CAPACITY);
+
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_remove_entry(&buffer),
+            "Expected nothing to remove from an empty buffer");
+
+    for (size_t i = 0; i < TEST_CAPACITY + 5; i++) {
+        add_command(&buffer, i);
+    }
+
+    // The oldest command left is 5, remove it and the next few
+
+    for (next = 5; next < 15; next++) {
+        entry = aesd_circular_buffer_remove_entry(&buffer);
+        TEST_ASSERT_NOT_NULL(entry);
+        TEST_ASSERT_EQUAL_PTR(commands[next], entry->buffptr);
+        TEST_ASSERT_FALSE_MESSAGE(buffer.full, "Expected removal to clear full");
+        verify_commands(&buffer, next + 1, TEST_CAPACITY + 5);
+    }
+
+    // Refill past capacity again, wrapping in_offs around while entries are removed
+
+    for (size_t i = TEST_CAPACITY + 5; i < 2 * TEST_CAPACITY + 15; i++) {
+        add_command(&buffer, i);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_commands(&buffer, TEST_CAPACITY + 15, 2 * TEST_CAPACITY + 15);
+
+    // Then empty it completely
+
+    for (next = TEST_CAPACITY + 15; next < 2 * TEST_CAPACITY + 15; next++) {
+        entry = aesd_circular_buffer_remove_entry(&buffer);
+        TEST_ASSERT_NOT_NULL(entry);
+        TEST_ASSERT_EQUAL_PTR(commands[next], entry->buffptr);
+    }
+    TEST_ASSERT_NULL(aesd_circular_buffer_remove_entry(&buffer));
+    verify_commands(&buffer, 0, 0);
+
+    // An emptied buffer takes new commands from fpos 0
+
+    add_command(&buffer, 0);
+    verify_commands(&buffer, 0, 1);
+}
+
+void test_circular_buffer_fpos_boundaries(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init_entries(&buffer, entries, TEST_CAPACITY);
+
+    // Every count of entries from 1 up to full, before any wraparound
+
+    for (size_t i = 0; i < TEST_CAPACITY; i++) {
+        add_command(&buffer, i);
+        verify_commands(&buffer, 0, i + 1);
+    }
+}
+
+void test_circular_buffer_fpos_after_remove(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t oldest;
+    size_t next = 0;
+
+    aesd_circular_buffer_init_entries(&buffer, entries, TEST_CAPACITY);
+
+    // Remove the oldest entries of a wrapped buffer down to a single one, then add
+    // again, so that out_offs and in_offs cross the end of the array in both orders
+
+    while (next < TEST_CAPACITY + 4) {
+        add_command(&buffer, next++);
+    }
+    oldest = next - TEST_CAPACITY;
+
+    while (next - oldest > 1) {
+        TEST_ASSERT_NOT_NULL(aesd_circular_buffer_remove_entry(&buffer));
+        oldest++;
+        verify_commands(&buffer, oldest, next);
+    }
+
+    while (next < TEST_COMMANDS) {
+        add_command(&buffer, next++);
+        if (next - oldest > TEST_CAPACITY) {
+            oldest++;
+        }
+        verify_commands(&buffer, oldest, next);
+    }
+}
+
+void test_circular_buffer_fpos_offset_wraparound(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    // Entry offsets are a running byte count that only matters relative to base, so
+    // lookups hold as it wraps around past SIZE_MAX
+
+    aesd_circular_buffer_init_entries(&buffer, entries, TEST_CAPACITY);
+    buffer.base = SIZE_MAX - 20;
+    buffer.end = SIZE_MAX - 20;
+
+    for (size_t i = 0; i < 2 * TEST_CAPACITY; i++) {
+        add_command(&buffer, i);
+        verify_commands(&buffer, i < TEST_CAPACITY ? 0 : i - TEST_CAPACITY + 1, i + 1);
+    }
+
+    TEST_ASSERT_TRUE_MESSAGE(buffer.end < SIZE_MAX - 20, "Expected the running byte count to wrap around");
+}